@@ -97,6 +97,7 @@ void core1_main() {
 
   while (true) {
     tuh_task(); // tinyusb host task
+    pio_usb_host_task(); // encode next SOF with PIO_USB_SOF_ENCODE_LOOKAHEAD
   }
 }
 
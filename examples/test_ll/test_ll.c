@@ -13,11 +13,13 @@
 #include "pio_usb.h"
 #include "pio_usb_configuration.h"
 #include "pio_usb_ll.h"
+#include "usb_crc.h"
 #include "usb_definitions.h"
 
 pio_usb_configuration_t pio_usb_config = PIO_USB_DEFAULT_CONFIG;
 
 static bool do_test(pio_port_t *pp);
+static void do_benchmark(void);
 
 int main() {
   // default 125MHz is not appropreate. Sysclock should be multiple of 12MHz.
@@ -147,6 +149,33 @@ int main() {
       int64_t diff = absolute_time_diff_us(start, end);
       printf("%f us (64bytes packet)", diff / 1000.0f);
     }
+
+    // Encoder and CRC results are checked on the host, see test/host
+
+    {
+      // Time spent in frame interrupt when PIO_USB_SOF_ENCODE_IN_IRQ
+      printf("\nTest 7: SOF Encode Speed\n");
+      uint8_t sof_packet[4] = {USB_SYNC, USB_PID_SOF, 0x00, 0x00};
+      uint8_t encoded_data[PIO_USB_TX_ENCODED_LEN(4)];
+
+      absolute_time_t start = get_absolute_time();
+      for (uint16_t frame = 0; frame < 2048; frame++) {
+        sof_packet[2] = frame & 0xff;
+        sof_packet[3] = (calc_usb_crc5(frame) << 3) | (frame >> 8);
+        pio_usb_ll_encode_tx_data(sof_packet, sizeof(sof_packet),
+                                  encoded_data);
+      }
+      absolute_time_t end = get_absolute_time();
+      int64_t diff = absolute_time_diff_us(start, end);
+      printf("%f us (per frame, saved in interrupt by LOOKAHEAD and TABLE)",
+             diff / 2048.0f);
+    }
+
+    {
+      // One "bench,<name>,<ns per call>" line per function
+      printf("\nTest 9: Benchmark\n");
+      do_benchmark();
+    }
   }
 }
 
@@ -159,6 +188,10 @@ static bool do_test(pio_port_t *pp) {
   ep->has_transfer = false;
   ep->is_tx = true;
   ep->size = 32;
+  if (!pio_usb_ll_alloc_buffer(ep, true)) {
+    printf("\t[NG] Failed to allocate endpoint buffer\n");
+    return false;
+  }
   pio_usb_ll_transfer_start(ep, test_data, sizeof(test_data));
 
   // Start receiver
@@ -167,7 +200,8 @@ static bool do_test(pio_port_t *pp) {
 
   uint32_t irq = save_and_disable_interrupts();
   // Start transmitter
-  pio_usb_bus_usb_transfer(pp, ep->buffer, ep->encoded_data_len);
+  pio_usb_bus_usb_transfer(pp, pio_usb_ll_get_tx_data(ep),
+                           pio_usb_ll_get_tx_data_len(ep));
   restore_interrupts(irq);
 
   // Check received data
@@ -175,6 +209,30 @@ static bool do_test(pio_port_t *pp) {
   memset(received, 0, sizeof(received));
   uint8_t received_cnt = 0;
 
+#if PIO_USB_RX_WORD_PUSH
+  // Bytes are pushed by word. Flush bytes left in ISR after EOP.
+  while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
+    continue;
+  }
+  while (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
+    if (sizeof(received) - received_cnt < 4) {
+      printf("\t[NG] Invalid size\n");
+      success = false;
+      break;
+    }
+    uint32_t word = pio_sm_get(pp->pio_usb_rx, pp->sm_rx);
+    memcpy(&received[received_cnt], &word, 4);
+    received_cnt += 4;
+  }
+  uint32_t word;
+  uint8_t word_len = pio_usb_bus_flush_rx_word(pp, &word);
+  if (sizeof(received) - received_cnt < word_len) {
+    printf("\t[NG] Invalid size\n");
+    success = false;
+  } else {
+    memcpy(&received[received_cnt], &word, word_len);
+  }
+#else
   while (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
     if (received_cnt >= sizeof(received)) {
       printf("\t[NG] Invalid size\n");
@@ -183,6 +241,7 @@ static bool do_test(pio_port_t *pp) {
     }
     received[received_cnt++] = pio_sm_get(pp->pio_usb_rx, pp->sm_rx) >> 24;
   }
+#endif
 
   for (size_t i = 0; i < sizeof(received); i++) {
     printf("%02x ", received[i]);
@@ -198,6 +257,62 @@ static bool do_test(pio_port_t *pp) {
   }
 
   ep->has_transfer = false;
+  pio_usb_ll_free_buffer(ep);
 
   return success;
-}
\ No newline at end of file
+}
+
+#define BENCHMARK(name, count, expr)                                   \
+  do {                                                                 \
+    absolute_time_t start = get_absolute_time();                       \
+    for (int i = 0; i < (count); i++) {                                \
+      expr;                                                            \
+    }                                                                  \
+    int64_t diff = absolute_time_diff_us(start, get_absolute_time());  \
+    printf("bench,%s,%d\n", name, (int)(diff * 1000 / (count)));       \
+  } while (0)
+
+static void do_benchmark(void) {
+  static uint8_t buffer[PIO_USB_EP_SIZE];
+  static uint8_t encoded[PIO_USB_TX_ENCODED_LEN(PIO_USB_EP_SIZE)];
+  static endpoint_t ep;
+  static uint8_t token_encoded[EP_TOKEN_CNT][PIO_USB_TX_TOKEN_ROOM];
+  volatile uint32_t sink = 0;
+
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = i;
+  }
+  ep.dev_addr = 0x15;
+  ep.ep_num = 0x0e;
+  ep.is_tx = true;
+  ep.token_encoded = token_encoded;
+
+  uint32_t const irq = save_and_disable_interrupts();
+  BENCHMARK("calc_usb_crc5", 10000, sink += calc_usb_crc5(i & 0x7ff));
+  BENCHMARK("calc_usb_crc16_64", 1000,
+            sink += calc_usb_crc16(buffer, sizeof(buffer)));
+  BENCHMARK("update_usb_crc16", 10000,
+            sink = update_usb_crc16(sink, (uint8_t)i));
+  BENCHMARK("calc_usb_crc16_nibble_64", 1000,
+            sink += calc_usb_crc16_nibble(buffer, sizeof(buffer)));
+  BENCHMARK("update_usb_crc16_nibble", 10000,
+            sink = update_usb_crc16_nibble(sink, (uint8_t)i));
+  BENCHMARK("calc_usb_crc16_slice4_64", 1000,
+            sink += calc_usb_crc16_slice4(buffer, sizeof(buffer)));
+  usb_crc16_interp_init();
+  BENCHMARK("calc_usb_crc16_interp_64", 1000,
+            sink += calc_usb_crc16_interp(buffer, sizeof(buffer)));
+  BENCHMARK("update_usb_crc16_interp", 10000,
+            sink = update_usb_crc16_interp(sink, (uint8_t)i));
+  BENCHMARK("encode_tx_data_8", 1000,
+            sink += pio_usb_ll_encode_tx_data(buffer, 8, encoded));
+  BENCHMARK("encode_tx_data_64", 1000,
+            sink += pio_usb_ll_encode_tx_data(buffer, sizeof(buffer), encoded));
+  memset(buffer, 0xff, sizeof(buffer)); // worst case bit stuffing
+  BENCHMARK("encode_tx_data_64_stuffed", 1000,
+            sink += pio_usb_ll_encode_tx_data(buffer, sizeof(buffer), encoded));
+  BENCHMARK("encode_token", 1000, pio_usb_ll_encode_token(&ep));
+  BENCHMARK("bus_prepare_receive", 1000,
+            pio_usb_bus_prepare_receive(PIO_USB_PIO_PORT(0)));
+  restore_interrupts(irq);
+}
@@ -26,15 +26,71 @@
 
 #define UNUSED_PARAMETER(x) (void)x
 
+// Timeout to detect packets without an EOP because the device was unplugged.
+// That is enough time to receive one FIFO entry at low speed.
+#if PIO_USB_RX_WORD_PUSH
+#define RX_TIMEOUT_US 24
+#else
+#define RX_TIMEOUT_US 7
+#endif
+
+#if PIO_USB_RX_TIMEOUT_IN_PIO
+// Timeouts counted by watchdog state machine, in bit times. Response should
+// start within 18 bit times after EOP (USB 2.0 7.1.19.1), and the next FIFO
+// entry comes within its bits plus stuff bits.
+#define RX_START_TIMEOUT_BITS 20
+#if PIO_USB_RX_WORD_PUSH
+#define RX_TIMEOUT_BITS 40
+#else
+#define RX_TIMEOUT_BITS 16
+#endif
+// Watchdog counts a tick per 4 TX cycles
+#define RX_TIMEOUT_TICKS(bits) ((bits) * PIO_USB_TX_CYCLES_PER_BIT / 4)
+#endif
+
+// CRC16 backend of each use site
+#if PIO_USB_CRC16_RX == PIO_USB_CRC16_NIBBLE
+#define update_rx_crc16(crc, data) update_usb_crc16_nibble(crc, data)
+#elif PIO_USB_CRC16_RX == PIO_USB_CRC16_INTERP
+#define update_rx_crc16(crc, data) update_usb_crc16_interp(crc, data)
+#else
+#define update_rx_crc16(crc, data) update_usb_crc16(crc, data)
+#endif
+
+#if PIO_USB_CRC16_TX == PIO_USB_CRC16_NIBBLE
+#define update_tx_crc16(crc, data) update_usb_crc16_nibble(crc, data)
+#elif PIO_USB_CRC16_TX == PIO_USB_CRC16_INTERP
+#define update_tx_crc16(crc, data) update_usb_crc16_interp(crc, data)
+#elif PIO_USB_CRC16_TX == PIO_USB_CRC16_TABLE
+#define update_tx_crc16(crc, data) update_usb_crc16(crc, data)
+#endif
+
 usb_device_t pio_usb_device[PIO_USB_DEVICE_CNT];
 pio_port_t pio_port[1];
 root_port_t pio_usb_root_port[PIO_USB_ROOT_PORT_CNT];
 endpoint_t pio_usb_ep_pool[PIO_USB_EP_POOL_CNT];
+spin_lock_t *pio_usb_ep_lock;
+
+#if PIO_USB_EP_BUFFER_ARENA_SIZE
+static uint8_t ep_buffer_arena_default[PIO_USB_EP_BUFFER_ARENA_SIZE];
+#endif
+static uint8_t *ep_buffer_arena;
+static uint32_t ep_buffer_arena_size;
+
+static uint8_t ack_encoded[PIO_USB_TX_HANDSHAKE_LEN];
+static uint8_t nak_encoded[PIO_USB_TX_HANDSHAKE_LEN];
+static uint8_t stall_encoded[PIO_USB_TX_HANDSHAKE_LEN];
+static uint8_t pre_encoded[PIO_USB_TX_HANDSHAKE_LEN];
+#if PIO_USB_HANDSHAKE_PREARM
+// Handshakes sent by TX state machine at EOP. Leading idle symbols make
+// inter-packet delay, see arm_handshake().
+static uint8_t ack_armed[PIO_USB_TX_HANDSHAKE_LEN + 1];
+static uint8_t nak_armed[PIO_USB_TX_HANDSHAKE_LEN + 1];
+static uint8_t stall_armed[PIO_USB_TX_HANDSHAKE_LEN + 1];
+#endif
 
-static uint8_t ack_encoded[5];
-static uint8_t nak_encoded[5];
-static uint8_t stall_encoded[5];
-static uint8_t pre_encoded[5];
+static uint8_t encode_chained_token(uint8_t const *packet,
+                                    uint8_t *encoded_data);
 
 //--------------------------------------------------------------------+
 // Bus functions
@@ -43,8 +99,10 @@ static uint8_t pre_encoded[5];
 static void __no_inline_not_in_flash_func(send_pre)(pio_port_t *pp) {
   // send PRE token in full-speed
   pp->low_speed = false;
-  uint16_t instr = pp->fs_tx_pre_program->instructions[0];
-  pp->pio_usb_tx->instr_mem[pp->offset_tx] = instr;
+  uint16_t instr =
+      pp->fs_tx_pre_program->instructions[PIO_USB_TX_EOP_INSTR_OFFSET];
+  pp->pio_usb_tx->instr_mem[pp->offset_tx + PIO_USB_TX_EOP_INSTR_OFFSET] =
+      instr;
 
   SM_SET_CLKDIV(pp->pio_usb_tx, pp->sm_tx, pp->clk_div_fs_tx);
 
@@ -59,17 +117,25 @@ static void __no_inline_not_in_flash_func(send_pre)(pio_port_t *pp) {
   // Wait for complete transmission of the PRE packet. We don't want to
   // accidentally send trailing Ks in low speed mode due to an early start
   // instruction that re-enables the outputs.
+#if PIO_USB_TX_ENCODE_IN_PIO
+  io_ro_32 *pc = &pp->pio_usb_tx->sm[pp->sm_tx].addr;
+  while (*pc != pp->offset_tx + usb_tx_nrzi_dpdm_offset_idle) {
+    continue;
+  }
+#else
   uint32_t stall_mask = 1 << (PIO_FDEBUG_TXSTALL_LSB + pp->sm_tx);
   pp->pio_usb_tx->fdebug = stall_mask; // clear sticky stall mask bit
   while (!(pp->pio_usb_tx->fdebug & stall_mask)) {
     continue;
   }
+#endif
 
   // change bus speed to low-speed
   pp->low_speed = true;
   pio_sm_set_enabled(pp->pio_usb_tx, pp->sm_tx, false);
-  instr = pp->fs_tx_program->instructions[0];
-  pp->pio_usb_tx->instr_mem[pp->offset_tx] = instr;
+  instr = pp->fs_tx_program->instructions[PIO_USB_TX_EOP_INSTR_OFFSET];
+  pp->pio_usb_tx->instr_mem[pp->offset_tx + PIO_USB_TX_EOP_INSTR_OFFSET] =
+      instr;
   SM_SET_CLKDIV(pp->pio_usb_tx, pp->sm_tx, pp->clk_div_ls_tx);
   pio_sm_set_enabled(pp->pio_usb_tx, pp->sm_tx, true);
 
@@ -82,16 +148,7 @@ static void __no_inline_not_in_flash_func(send_pre)(pio_port_t *pp) {
   pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_eop, true);
 }
 
-void __not_in_flash_func(pio_usb_bus_usb_transfer)(pio_port_t *pp,
-                                              uint8_t *data, uint16_t len) {
-  if (pp->need_pre) {
-    send_pre(pp);
-  }
-
-  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
-  dma_channel_transfer_from_buffer_now(pp->tx_ch, data, len);
-  pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK; // clear complete flag
-
+static __always_inline void wait_tx_complete(pio_port_t *pp) {
   io_ro_32 *pc = &pp->pio_usb_tx->sm[pp->sm_tx].addr;
   while ((pp->pio_usb_tx->irq & IRQ_TX_ALL_MASK) == 0) {
     continue;
@@ -102,6 +159,16 @@ void __not_in_flash_func(pio_usb_bus_usb_transfer)(pio_port_t *pp,
     // For Low speed host, wait until EOP is fully sent. Otherwise, we can send another packet
     // before inter-packet delay timeout, which is 2-bit time by USB specs.
     // For Full speed, our overhead is probably enough without this additional wait.
+#if PIO_USB_TX_ENCODE_IN_PIO
+    while (*pc < pp->offset_tx + usb_tx_nrzi_dpdm_offset_idle) {
+      continue;
+    }
+  } else {
+    while (*pc <= pp->offset_tx + usb_tx_nrzi_dpdm_offset_se0) {
+      continue;
+    }
+  }
+#else
     while (*pc <= PIO_USB_TX_ENCODED_DATA_COMP) {
       continue;
     }
@@ -110,35 +177,151 @@ void __not_in_flash_func(pio_usb_bus_usb_transfer)(pio_port_t *pp,
       continue;
     }
   }
+#endif
 }
 
-void __no_inline_not_in_flash_func(pio_usb_bus_send_token)(pio_port_t *pp,
-                                                           uint8_t token,
-                                                           uint8_t addr,
-                                                           uint8_t ep_num) {
+void __not_in_flash_func(pio_usb_bus_usb_transfer)(pio_port_t *pp,
+                                              uint8_t *data, uint16_t len) {
+  if (pp->need_pre) {
+    send_pre(pp);
+  }
 
-  uint8_t packet[4] = {USB_SYNC, token, 0, 0};
+  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
+  dma_channel_transfer_from_buffer_now(pp->tx_ch, data, len);
+  pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK; // clear complete flag
+
+  wait_tx_complete(pp);
+}
+
+static void make_token_packet(uint8_t *packet, uint8_t token, uint8_t addr,
+                              uint8_t ep_num) {
   uint16_t dat = ((uint16_t)(ep_num & 0xf) << 7) | (addr & 0x7f);
   uint8_t crc = calc_usb_crc5(dat);
+  packet[0] = USB_SYNC;
+  packet[1] = token;
   packet[2] = dat & 0xff;
   packet[3] = (crc << 3) | ((dat >> 8) & 0x1f);
+}
 
-  uint8_t packet_encoded[sizeof(packet) * 2 * 7 / 6 + 2];
+void __no_inline_not_in_flash_func(pio_usb_bus_send_token)(pio_port_t *pp,
+                                                           uint8_t token,
+                                                           uint8_t addr,
+                                                           uint8_t ep_num) {
+
+  uint8_t packet[4];
+  make_token_packet(packet, token, addr, ep_num);
+
+  uint8_t packet_encoded[PIO_USB_TX_ENCODED_LEN(sizeof(packet))];
   uint8_t encoded_len = pio_usb_ll_encode_tx_data(packet, sizeof(packet), packet_encoded);
 
   pio_usb_bus_usb_transfer(pp, packet_encoded, encoded_len);
 }
 
+// Send pre-encoded token and DATA packet of ep by a single DMA transfer.
+// Token is placed right before the encoded DATA packet, and TX program goes on
+// to the DATA packet without releasing the bus.
+void __no_inline_not_in_flash_func(pio_usb_bus_send_token_and_data)(
+    pio_port_t *pp, endpoint_t *ep, ep_token_t token) {
+  uint8_t *data = pio_usb_ll_get_tx_data(ep);
+  uint16_t const data_len = pio_usb_ll_get_tx_data_len(ep);
+  uint8_t const encoded_len = ep->token_encoded_len[token];
+
+  if (pp->need_pre) {
+    // Each low-speed packet requires its own PRE
+    pio_usb_bus_usb_transfer(pp, ep->token_encoded[token], encoded_len);
+    pio_usb_bus_usb_transfer(pp, data, data_len);
+    return;
+  }
+
+  uint8_t *start = data - encoded_len;
+  memcpy(start, ep->token_encoded[token], encoded_len);
+
+  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
+  dma_channel_transfer_from_buffer_now(pp->tx_ch, start,
+                                       encoded_len + data_len);
+  pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK; // clear complete flag
+
+  // EOP of token
+  while ((pp->pio_usb_tx->irq & IRQ_TX_EOP_MASK) == 0) {
+    continue;
+  }
+  pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK;
+
+  wait_tx_complete(pp);
+}
+
+// Decoder is kept enabled. Drop stale entries left from the previous packet
+// and reset the decoder without stopping it.
 void __no_inline_not_in_flash_func(pio_usb_bus_prepare_receive)(const pio_port_t *pp) {
-  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, false);
-  pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
-  pio_sm_restart(pp->pio_usb_rx, pp->sm_rx);
-  pio_sm_exec(pp->pio_usb_rx, pp->sm_rx, pp->rx_reset_instr);
-  pio_sm_exec(pp->pio_usb_rx, pp->sm_rx, pp->rx_reset_instr2);
-  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, true);
+  if (!pio_sm_is_rx_fifo_empty(pp->pio_usb_rx, pp->sm_rx)) {
+    pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
+  }
+  pio_usb_bus_rearm_receive(pp);
+}
+
+// Restart timeout for the next RX FIFO entry. Returns start time to be passed
+// to rx_timeout_expired().
+static __always_inline uint32_t rx_timeout_restart(const pio_port_t *pp) {
+#if PIO_USB_RX_TIMEOUT_IN_PIO
+  pio_sm_exec(pp->pio_usb_rx, pp->sm_rx_timeout,
+              pio_encode_mov(pio_x, pio_osr));
+  return 0;
+#else
+  (void)pp;
+  return get_time_us_32();
+#endif
+}
+
+static __always_inline bool rx_timeout_expired(const pio_port_t *pp,
+                                               uint32_t start) {
+#if PIO_USB_RX_TIMEOUT_IN_PIO
+  (void)start;
+  return (pp->pio_usb_rx->irq & IRQ_RX_TIMEOUT_MASK) != 0;
+#else
+  (void)pp;
+  return get_time_us_32() - start > RX_TIMEOUT_US;
+#endif
 }
 
+#if PIO_USB_RX_BS_ERR_CHECK
+// Drop the rest of a packet with bit stuffing error. Wait for its EOP, so that
+// the next packet is not sent while the device is still sending.
+static void __no_inline_not_in_flash_func(drop_rx_packet)(pio_port_t *pp) {
+  pp->root->rx_bs_err_count++;
+#if PIO_USB_RX_DMA
+  dma_channel_abort(pp->rx_ch);
+#endif
+  uint32_t start = rx_timeout_restart(pp);
+  while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
+    if (!pio_sm_is_rx_fifo_empty(pp->pio_usb_rx, pp->sm_rx)) {
+      pio_sm_get(pp->pio_usb_rx, pp->sm_rx);
+      start = rx_timeout_restart(pp);
+    } else if (rx_timeout_expired(pp, start)) {
+      break;
+    }
+  }
+}
+#endif
+
 static inline __force_inline bool pio_usb_bus_wait_for_rx_start(const pio_port_t* pp) {
+#if PIO_USB_RX_TIMEOUT_IN_PIO
+  PIO pio = pp->pio_usb_rx;
+  uint sm = pp->sm_rx_timeout;
+  // Tick at the TX clock of current bus speed, then load response timeout
+  pio->sm[sm].clkdiv = pp->pio_usb_tx->sm[pp->sm_tx].clkdiv;
+  pio_sm_exec(pio, sm, pio_encode_mov(pio_x, pio_isr));
+  pio_sm_exec(pio, sm, pio_encode_jmp(pp->offset_rx_timeout));
+  pio->irq = IRQ_RX_TIMEOUT_MASK;
+  while (1) {
+    uint32_t irq = pio->irq;
+    if ((irq & IRQ_RX_START_MASK) != 0) {
+      rx_timeout_restart(pp); // timeout of the first byte
+      return true;
+    } else if ((irq & IRQ_RX_TIMEOUT_MASK) != 0) {
+      return false;
+    }
+  }
+#else
   // USB 2.0 specs: 7.1.19.1: handshake timeout
   // Full-Speed (12 Mbps): 1 bit time = 1 / 12 MHz = 83.3 ns --> 16 bit times = 1.33 µs
   // Low-Speed (1.5 Mbps): 1 bit time = 1 / 1.5 MHz = 666.7 ns --> 16 bit times = 10.67 µs
@@ -154,6 +337,7 @@ static inline __force_inline bool pio_usb_bus_wait_for_rx_start(const pio_port_t
     }
   }
   return false;
+#endif
 };
 
 uint8_t __no_inline_not_in_flash_func(pio_usb_bus_wait_handshake)(pio_port_t* pp) {
@@ -161,49 +345,100 @@ uint8_t __no_inline_not_in_flash_func(pio_usb_bus_wait_handshake)(pio_port_t* pp
     return 0;
   }
 
+  uint8_t packet[2] = {0, 0};
   int16_t idx = 0;
-  // Timeout in seven microseconds. That is enough time to receive one byte at low speed.
-  // This is to detect packets without an EOP because the device was unplugged.
-  uint32_t start = get_time_us_32();
-  while (get_time_us_32() - start <= 7) {
+  uint32_t start = rx_timeout_restart(pp);
+  while (!rx_timeout_expired(pp, start)) {
+#if PIO_USB_RX_BS_ERR_CHECK
+    if ((pp->pio_usb_rx->irq & IRQ_RX_BS_ERR_MASK) != 0) {
+      drop_rx_packet(pp);
+      return 0;
+    }
+#endif
+#if PIO_USB_RX_WORD_PUSH
+    // Handshake packet is shorter than a word
+    if (!pio_sm_is_rx_fifo_empty(pp->pio_usb_rx, pp->sm_rx)) {
+      break;
+    } else if ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) != 0) {
+      uint32_t word;
+      idx = pio_usb_bus_flush_rx_word(pp, &word);
+      packet[0] = word;
+      packet[1] = word >> 8;
+      break;
+    }
+#else
     if (idx < 2 && pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
       uint8_t data = pio_sm_get(pp->pio_usb_rx, pp->sm_rx) >> 24;
-      pp->usb_rx_buffer[idx++] = data;
+      packet[idx++] = data;
 
-      start = get_time_us_32(); // reset timeout when a byte is received
+      start = rx_timeout_restart(pp); // reset timeout when a byte is received
     } else if ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) != 0) {
       break; // exit if we've gotten an EOP
     }
+#endif
   }
 
-  if (idx != 2 || pp->usb_rx_buffer[0] != USB_SYNC) {
+  if (idx != 2 || packet[0] != USB_SYNC) {
     return 0; // invalid handshake
   }
 
-  return pp->usb_rx_buffer[1];
+  return packet[1];
+}
+
+#if PIO_USB_HANDSHAKE_PREARM
+// Let TX state machine wait for EOP flag of the edge detector, then send
+// handshake. EOP flag is set about one bit time after SE0 starts. TX waits 2
+// more bit times before driving J, and sends 4 idle bits before SYNC. That
+// makes about 5 bit times of inter-packet delay. TX stays disabled until
+// software enables it.
+static __always_inline void arm_handshake(pio_port_t *pp, uint8_t *handshake,
+                                          uint16_t len) {
+  pio_sm_set_enabled(pp->pio_usb_tx, pp->sm_tx, false);
+  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
+  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_arm_instr); // stalls
+  pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK;
+  dma_channel_transfer_from_buffer_now(pp->tx_ch, handshake, len);
+}
+
+static __always_inline void disarm_handshake(pio_port_t *pp) {
+  dma_channel_abort(pp->tx_ch);
+  pio_sm_clear_fifos(pp->pio_usb_tx, pp->sm_tx);
+  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_reset_instr);
+  pio_sm_set_enabled(pp->pio_usb_tx, pp->sm_tx, true);
 }
+#endif
 
-int __no_inline_not_in_flash_func(pio_usb_bus_receive_packet_and_handshake)(
-    pio_port_t *pp, uint8_t handshake) {
+// Receive DATA packet and send handshake. Data is written to buffer directly,
+// and PID of the received packet, or 0 if none, to *pid. CRC of a short packet
+// is written to buffer after data, so buffer up to buflen may be overwritten.
+// Packet longer than buflen is babble, which is not acknowledged and returns
+// -1. Returns length of data. handshake 0 sends none, for isochronous
+// transfers.
+int __no_inline_not_in_flash_func(pio_usb_bus_receive_data_and_handshake)(
+    pio_port_t *pp, uint8_t handshake, uint8_t *buffer, uint16_t buflen,
+    uint8_t *pid) {
   uint16_t crc = 0xffff;
   uint16_t crc_prev = 0xffff;
   uint16_t crc_prev2 = 0xffff;
   uint16_t crc_receive = 0xffff;
   bool crc_match = false;
-  const uint16_t rx_buf_len = sizeof(pp->usb_rx_buffer) / sizeof(pp->usb_rx_buffer[0]);
   int16_t idx = 0;
+  int res = -1;
 
   // Per USB Specs 7.1.18 for turnaround: We must wait at least 2 bit times for inter-packet delay.
   // This is essential for working with LS device specially when we overlocked the mcu.
   // Pre-calculate number of cycle per bit time
-  // - Lowspeed: 1 bit time = (cpufreq / 1.5 Mhz) = clk_div_ls_tx.div_int*6Mhz / 1.5 Mhz = 4 * clk_div_ls_tx.div_int
-  // - Fullspeed 1 bit time = (cpufreq / 12 Mhz) = clk_div_fs_tx.div_int*48Mhz / 12 Mhz = 4 * clk_div_fs_tx.div_int
+  // - Lowspeed: 1 bit time = (cpufreq / 1.5 Mhz) = PIO_USB_TX_CYCLES_PER_BIT * clk_div_ls_tx.div_int
+  // - Fullspeed 1 bit time = (cpufreq / 12 Mhz) = PIO_USB_TX_CYCLES_PER_BIT * clk_div_fs_tx.div_int
   // Since there is also overhead, we only wait 1.5 bit for LS and no wait for FS
   uint32_t turnaround_in_cycle = 0;
   if (pp->low_speed) {
-    turnaround_in_cycle = 6 * pp->clk_div_ls_tx.div_int; // 1.5 bit time
+    turnaround_in_cycle = PIO_USB_TX_CYCLES_PER_BIT * 3 / 2 *
+                          pp->clk_div_ls_tx.div_int; // 1.5 bit time
   }
 
+  *pid = 0; // no PID unless it is received
+
   if (!pio_usb_bus_wait_for_rx_start(pp)) {
     return -1;
   }
@@ -211,28 +446,133 @@ int __no_inline_not_in_flash_func(pio_usb_bus_receive_packet_and_handshake)(
   // Timing Critical: use local variable to reduce de-reference
   PIO pio_usb_rx = pp->pio_usb_rx;
   uint sm_rx =  pp->sm_rx;
+#if PIO_USB_RX_DMA
   uint8_t *usb_rx_buffer = pp->usb_rx_buffer;
+#endif
 
-  // Timeout in seven microseconds. That is enough time to receive one byte at low speed.
-  // This is to detect packets without an EOP because the device was unplugged.
-  uint32_t start = get_time_us_32();
+#if PIO_USB_HANDSHAKE_PREARM
+  // TX state machine in the same PIO can see EOP flag
+  bool armed = handshake != 0 && !pp->need_pre && pp->pio_usb_tx == pio_usb_rx;
+  bool tx_enabled = false;
+  io_ro_32 *tx_pc = &pp->pio_usb_tx->sm[pp->sm_tx].addr;
+  if (armed) {
+    if (handshake == USB_PID_ACK) {
+      arm_handshake(pp, ack_armed, sizeof(ack_armed));
+    } else {
+      arm_handshake(pp, handshake == USB_PID_NAK ? nak_armed : stall_armed,
+                    sizeof(nak_armed));
+      tx_enabled = true;
+      pio_sm_set_enabled(pp->pio_usb_tx, pp->sm_tx, true);
+    }
+  }
+#endif
+
+#if PIO_USB_RX_DMA
+  // Bytes land in usb_rx_buffer by DMA. Follow its write pointer to calculate
+  // CRC while packet is arriving.
+  const uint16_t rx_buf_len = PIO_USB_RX_BUFFER_SIZE;
+  dma_channel_transfer_to_buffer_now(pp->rx_ch, usb_rx_buffer, rx_buf_len);
+  io_rw_32 const *dma_remaining =
+      &dma_channel_hw_addr(pp->rx_ch)->transfer_count;
+#else
+  int16_t const buf_end = buflen + 2;
+#endif
+#if PIO_USB_RX_WORD_PUSH
+  uint32_t word = 0;
+  uint8_t word_len = 0;
+  bool word_flushed = false;
+#endif
+
+  uint32_t start = rx_timeout_restart(pp);
   while (1) {
+#if PIO_USB_RX_DMA
+    if (idx < (int16_t)(rx_buf_len - *dma_remaining)) {
+      uint8_t data = usb_rx_buffer[idx];
+#else
+#if PIO_USB_RX_WORD_PUSH
+    if (word_len == 0 && !pio_sm_is_rx_fifo_empty(pio_usb_rx, sm_rx)) {
+      word = pio_sm_get(pio_usb_rx, sm_rx);
+      word_len = 4;
+    }
+    if (word_len) {
+      uint8_t data = word;
+      word >>= 8;
+      word_len--;
+#else
     if (pio_sm_get_rx_fifo_level(pio_usb_rx, sm_rx)) {
       uint8_t data = pio_sm_get(pio_usb_rx, sm_rx) >> 24;
-      if (idx < rx_buf_len) {
-        usb_rx_buffer[idx] = data;
+#endif
+      if (idx >= 2 && idx < buf_end) {
+        buffer[idx - 2] = data;
       }
-      start = get_time_us_32(); // reset timeout when a byte is received
+#endif
+      start = rx_timeout_restart(pp); // reset timeout when a byte is received
 
-      if (idx >= 2) {
+      if (idx == 1) {
+        *pid = data;
+      } else if (idx >= 2) {
         crc_prev2 = crc_prev;
         crc_prev = crc;
-        crc = update_usb_crc16(crc, data);
+        crc = update_rx_crc16(crc, data);
         crc_receive = (crc_receive >> 8) | (data << 8);
         crc_match = ((crc_receive ^ 0xffff) == crc_prev2);
+#if PIO_USB_HANDSHAKE_PREARM
+        if (armed && handshake == USB_PID_ACK) {
+          // ACK goes out if EOP follows this byte
+          bool const enable = idx >= 3 && crc_match && idx - 3 <= buflen;
+          if (enable != tx_enabled) {
+            tx_enabled = enable;
+            pio_sm_set_enabled(pp->pio_usb_tx, pp->sm_tx, tx_enabled);
+          }
+        }
+#endif
       }
       idx++;
-    } else if ((pio_usb_rx->irq & IRQ_RX_COMP_MASK) != 0) {
+#if PIO_USB_HANDSHAKE_PREARM
+    } else if (tx_enabled) {
+      if (*tx_pc != pp->offset_tx + usb_tx_dpdm_offset_start) {
+        // TX state machine took EOP flag and is sending handshake. Then wait
+        // until edge detector stops at EOP of it.
+        armed = false;
+        wait_tx_complete(pp);
+        start = rx_timeout_restart(pp);
+        while ((pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0 &&
+               !rx_timeout_expired(pp, start)) {
+          continue;
+        }
+        if (handshake == USB_PID_ACK) {
+          res = idx - 4;
+        }
+        break;
+      } else if (rx_timeout_expired(pp, start)) {
+        break; // device is probably unplugged
+      }
+#endif
+#if PIO_USB_RX_BS_ERR_CHECK
+    } else if ((pio_usb_rx->irq & IRQ_RX_BS_ERR_MASK) != 0) {
+      drop_rx_packet(pp); // no handshake
+      break;
+#endif
+    } else if ((pio_usb_rx->irq & IRQ_RX_COMP_MASK) != 0
+#if PIO_USB_RX_DMA
+               && pio_sm_is_rx_fifo_empty(pio_usb_rx, sm_rx)
+#endif
+    ) {
+#if PIO_USB_HANDSHAKE_PREARM
+      if (armed) {
+        // ACK is cancelled. Check CRC again and respond by software.
+        armed = false;
+        disarm_handshake(pp);
+      }
+#endif
+#if PIO_USB_RX_WORD_PUSH
+      if (!word_flushed) {
+        // Process bytes left in ISR before handshake
+        word_flushed = true;
+        word_len = pio_usb_bus_flush_rx_word(pp, &word);
+        continue;
+      }
+#endif
       // Exit since we've gotten an EOP.
       // Timing critical: per USB specs, handshake must be sent within 2-7 bit-time strictly
       if (turnaround_in_cycle) {
@@ -240,23 +580,33 @@ int __no_inline_not_in_flash_func(pio_usb_bus_receive_packet_and_handshake)(
       }
 
       if (handshake == USB_PID_ACK) {
-        // Only ACK if crc matches
-        if (idx >= 4 && crc_match) {
-          pio_usb_bus_usb_transfer(pp, ack_encoded, 5);
-          return idx - 4;
+        // Only ACK if crc matches and data fits
+        if (idx >= 4 && crc_match && idx - 4 <= buflen) {
+          pio_usb_bus_usb_transfer(pp, ack_encoded, sizeof(ack_encoded));
+          res = idx - 4;
         }
       } else if (handshake == USB_PID_NAK) {
-        pio_usb_bus_usb_transfer(pp, nak_encoded, 5);
-      } else {
-        pio_usb_bus_usb_transfer(pp, stall_encoded, 5);
+        pio_usb_bus_usb_transfer(pp, nak_encoded, sizeof(nak_encoded));
+      } else if (handshake == USB_PID_STALL) {
+        pio_usb_bus_usb_transfer(pp, stall_encoded, sizeof(stall_encoded));
+      } else if (idx >= 4 && crc_match && idx - 4 <= buflen) {
+        res = idx - 4; // isochronous, no handshake
       }
       break;
-    } else if (get_time_us_32() - start > 7) {
-      return -1; // device is probably unplugged
+    } else if (rx_timeout_expired(pp, start)) {
+      break; // device is probably unplugged
     }
   }
 
-  return -1;
+#if PIO_USB_RX_DMA
+  dma_channel_abort(pp->rx_ch);
+  // DMA lands whole packet in usb_rx_buffer
+  if (res > 0 && buffer != usb_rx_buffer + 2) {
+    memcpy(buffer, usb_rx_buffer + 2, res); // res doesn't exceed buflen
+  }
+#endif
+
+  return res;
 }
 
 static __always_inline void add_pio_host_rx_program(PIO pio,
@@ -270,11 +620,43 @@ static __always_inline void add_pio_host_rx_program(PIO pio,
   }
 }
 
+// Place re-arm prologue just before the decoder, if RX PIO still has
+// reserved_len instructions for the programs loaded after it.
+static bool add_rx_rearm_program(PIO pio, uint offset_rx, uint reserved_len) {
+  const pio_program_t *program = &usb_nrzi_decoder_rearm_program;
+  if (offset_rx < program->length ||
+      !pio_can_add_program_at_offset(pio, program,
+                                     offset_rx - program->length)) {
+    return false;
+  }
+  pio_add_program_at_offset(pio, program, offset_rx - program->length);
+
+  const pio_program_t reserved = {
+      .instructions = NULL,
+      .length = reserved_len,
+      .origin = -1,
+  };
+  if (!pio_can_add_program(pio, &reserved)) {
+    pio_remove_program(pio, program, offset_rx - program->length);
+    return false;
+  }
+
+  return true;
+}
+
 static void __no_inline_not_in_flash_func(initialize_host_programs)(
     pio_port_t *pp, const pio_usb_configuration_t *c, root_port_t *port) {
   // TX program should be placed at address 0
   pio_add_program_at_offset(pp->pio_usb_tx, pp->fs_tx_program, 0);
   pp->offset_tx = 0;
+#if PIO_USB_TX_ENCODE_IN_PIO
+  usb_tx_nrzi_fs_program_init(pp->pio_usb_tx, pp->sm_tx, pp->offset_tx,
+                              port->pin_dp, port->pin_dm);
+  pp->tx_start_instr =
+      pio_encode_jmp(pp->offset_tx + usb_tx_nrzi_dpdm_offset_start);
+  pp->tx_reset_instr =
+      pio_encode_jmp(pp->offset_tx + usb_tx_nrzi_dpdm_offset_release);
+#else
   usb_tx_fs_program_init(pp->pio_usb_tx, pp->sm_tx, pp->offset_tx, port->pin_dp,
                          port->pin_dm);
   uint32_t sideset_fj_lk;
@@ -284,15 +666,42 @@ static void __no_inline_not_in_flash_func(initialize_host_programs)(
     sideset_fj_lk = pio_encode_sideset(2, usb_tx_dmdp_FJ_LK);
   }
 
-  pp->tx_start_instr = pio_encode_jmp(pp->offset_tx + 4) | sideset_fj_lk;
+  pp->tx_start_instr =
+      pio_encode_jmp(pp->offset_tx + usb_tx_dpdm_offset_start) | sideset_fj_lk;
   pp->tx_reset_instr = pio_encode_jmp(pp->offset_tx + 2) | sideset_fj_lk;
+  // Wait for EOP of received packet, then 2 bit times before driving J
+  pp->tx_arm_instr = pio_encode_wait_irq(true, false, IRQ_RX_EOP) |
+                     pio_encode_delay(7) | sideset_fj_lk;
+#endif
 
+#if PIO_USB_RX_BS_ERR_CHECK
+  add_pio_host_rx_program(pp->pio_usb_rx, &usb_nrzi_decoder_bs_program,
+                          &usb_nrzi_decoder_bs_debug_program, &pp->offset_rx,
+                          c->debug_pin_rx);
+#else
   add_pio_host_rx_program(pp->pio_usb_rx, &usb_nrzi_decoder_program,
                           &usb_nrzi_decoder_debug_program, &pp->offset_rx,
                           c->debug_pin_rx);
+#endif
   usb_rx_fs_program_init(pp->pio_usb_rx, pp->sm_rx, pp->offset_rx, port->pin_dp,
                          port->pin_dm, c->debug_pin_rx);
-  pp->rx_reset_instr = pio_encode_jmp(pp->offset_rx);
+#if PIO_USB_RX_WORD_PUSH
+  // Autopush by 32 bits. Threshold 0 means 32.
+  hw_write_masked(&pp->pio_usb_rx->sm[pp->sm_rx].shiftctrl, 0,
+                  PIO_SM0_SHIFTCTRL_PUSH_THRESH_BITS);
+#endif
+  uint reserved_len = usb_edge_detector_program.length;
+#if PIO_USB_RX_TIMEOUT_IN_PIO
+  reserved_len += usb_rx_timeout_program.length;
+#endif
+  pp->rx_rearm_in_pio =
+      add_rx_rearm_program(pp->pio_usb_rx, pp->offset_rx, reserved_len);
+  if (pp->rx_rearm_in_pio) {
+    pp->rx_reset_instr = pio_encode_jmp(
+        pp->offset_rx - usb_nrzi_decoder_rearm_program.length);
+  } else {
+    pp->rx_reset_instr = pio_encode_jmp(pp->offset_rx);
+  }
   pp->rx_reset_instr2 = pio_encode_set(pio_x, 0);
 
   add_pio_host_rx_program(pp->pio_usb_rx, &usb_edge_detector_program,
@@ -307,6 +716,9 @@ static void __no_inline_not_in_flash_func(initialize_host_programs)(
   pio_sm_set_jmp_pin(pp->pio_usb_rx, pp->sm_rx, port->pin_dp);
   pio_sm_set_jmp_pin(pp->pio_usb_rx, pp->sm_eop, port->pin_dm);
   pio_sm_set_in_pins(pp->pio_usb_rx, pp->sm_eop, port->pin_dp);
+
+  // Decoder is kept enabled and re-armed by pio_usb_bus_prepare_receive()
+  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, true);
 }
 
 static void configure_tx_channel(uint8_t ch, PIO pio, uint sm) {
@@ -321,6 +733,19 @@ static void configure_tx_channel(uint8_t ch, PIO pio, uint sm) {
   dma_channel_set_write_addr(ch, &pio->txf[sm], false);
 }
 
+static __unused void configure_rx_channel(uint8_t ch, PIO pio, uint sm) {
+  dma_channel_config conf = dma_channel_get_default_config(ch);
+
+  channel_config_set_read_increment(&conf, false);
+  channel_config_set_write_increment(&conf, true);
+  channel_config_set_transfer_data_size(&conf, DMA_SIZE_8);
+  channel_config_set_dreq(&conf, pio_get_dreq(pio, sm, false));
+
+  dma_channel_set_config(ch, &conf, false);
+  // Received byte is in MSB since ISR shifts to right
+  dma_channel_set_read_addr(ch, (io_rw_8 *)&pio->rxf[sm] + 3, false);
+}
+
 static void apply_config(pio_port_t *pp, const pio_usb_configuration_t *c,
                          root_port_t *port) {
   pp->pio_usb_tx = pio_get_instance(c->pio_tx_num);
@@ -335,15 +760,27 @@ static void apply_config(pio_port_t *pp, const pio_usb_configuration_t *c,
   if (c->pinout == PIO_USB_PINOUT_DPDM) {
     port->pin_dm = c->pin_dp + 1;
     highest_pin = port->pin_dm;
+#if PIO_USB_TX_ENCODE_IN_PIO
+    pp->fs_tx_program = &usb_tx_nrzi_dpdm_program;
+    pp->fs_tx_pre_program = &usb_tx_nrzi_pre_dpdm_program;
+    pp->ls_tx_program = &usb_tx_nrzi_dmdp_program;
+#else
     pp->fs_tx_program = &usb_tx_dpdm_program;
     pp->fs_tx_pre_program = &usb_tx_pre_dpdm_program;
     pp->ls_tx_program = &usb_tx_dmdp_program;
+#endif
   } else {
     port->pin_dm = c->pin_dp - 1;
     highest_pin = port->pin_dp;
+#if PIO_USB_TX_ENCODE_IN_PIO
+    pp->fs_tx_program = &usb_tx_nrzi_dmdp_program;
+    pp->fs_tx_pre_program = &usb_tx_nrzi_pre_dmdp_program;
+    pp->ls_tx_program = &usb_tx_nrzi_dpdm_program;
+#else
     pp->fs_tx_program = &usb_tx_dmdp_program;
     pp->fs_tx_pre_program = &usb_tx_pre_dmdp_program;
     pp->ls_tx_program = &usb_tx_dpdm_program;
+#endif
   }
 
 #if defined(PICO_PIO_USE_GPIO_BASE) && PICO_PIO_USE_GPIO_BASE+0
@@ -375,13 +812,44 @@ static void port_pin_drive_setting(const root_port_t *port) {
 void pio_usb_bus_init(pio_port_t *pp, const pio_usb_configuration_t *c,
                       root_port_t *root) {
   memset(root, 0, sizeof(root_port_t));
+  pp->root = root;
+  if (pio_usb_ep_lock == NULL) {
+    pio_usb_ep_lock = spin_lock_instance(spin_lock_claim_unused(true));
+  }
 
   pp->pio_usb_tx = pio_get_instance(c->pio_tx_num);
   dma_claim_mask(1<<c->tx_ch);
   configure_tx_channel(c->tx_ch, pp->pio_usb_tx, c->sm_tx);
 
   apply_config(pp, c, root);
+#if PIO_USB_RX_DMA
+  pp->rx_ch = dma_claim_unused_channel(true);
+  configure_rx_channel(pp->rx_ch, pp->pio_usb_rx, pp->sm_rx);
+#endif
+  if (c->ep_buffer_arena) {
+    ep_buffer_arena = c->ep_buffer_arena;
+    ep_buffer_arena_size = c->ep_buffer_arena_size;
+  } else {
+#if PIO_USB_EP_BUFFER_ARENA_SIZE
+    ep_buffer_arena = ep_buffer_arena_default;
+    ep_buffer_arena_size = sizeof(ep_buffer_arena_default);
+#endif
+  }
+  pio_usb_ll_reset_buffers();
   initialize_host_programs(pp, c, root);
+#if PIO_USB_RX_TIMEOUT_IN_PIO
+  pp->sm_rx_timeout = pio_claim_unused_sm(pp->pio_usb_rx, true);
+  pp->offset_rx_timeout =
+      pio_add_program(pp->pio_usb_rx, &usb_rx_timeout_program);
+  usb_rx_timeout_program_init(pp->pio_usb_rx, pp->sm_rx_timeout,
+                              pp->offset_rx_timeout,
+                              RX_TIMEOUT_TICKS(RX_START_TIMEOUT_BITS),
+                              RX_TIMEOUT_TICKS(RX_TIMEOUT_BITS));
+#endif
+#if PIO_USB_CRC16_RX == PIO_USB_CRC16_INTERP || \
+    PIO_USB_CRC16_TX == PIO_USB_CRC16_INTERP
+  usb_crc16_interp_init();
+#endif
   port_pin_drive_setting(root);
   root->initialized = true;
   root->dev_addr = 0;
@@ -395,6 +863,13 @@ void pio_usb_bus_init(pio_port_t *pp, const pio_usb_configuration_t *c,
   pio_usb_ll_encode_tx_data(raw_packet, 2, stall_encoded);
   raw_packet[1] = USB_PID_PRE;
   pio_usb_ll_encode_tx_data(raw_packet, 2, pre_encoded);
+#if PIO_USB_HANDSHAKE_PREARM
+  ack_armed[0] = nak_armed[0] = stall_armed[0] =
+      PIO_USB_TX_ENCODED_DATA_K * 0x55; // idle
+  memcpy(ack_armed + 1, ack_encoded, sizeof(ack_encoded));
+  memcpy(nak_armed + 1, nak_encoded, sizeof(nak_encoded));
+  memcpy(stall_armed + 1, stall_encoded, sizeof(stall_encoded));
+#endif
 }
 
 //--------------------------------------------------------------------+
@@ -420,11 +895,11 @@ int __no_inline_not_in_flash_func(pio_usb_get_in_data)(endpoint_t *ep,
 
   if (ep->new_data_flag) {
     len = len < ep->actual_len ? len : ep->actual_len;
-    memcpy(buffer, (void *)ep->buffer, len);
+    memcpy(buffer, (void *)ep->buffer[0], len);
 
     ep->new_data_flag = false;
 
-    return pio_usb_ll_transfer_start(ep, ep->buffer, ep->size) ? len : -1;
+    return pio_usb_ll_transfer_start(ep, ep->buffer[0], ep->size) ? len : -1;
   }
 
   return -1;
@@ -451,94 +926,413 @@ void __no_inline_not_in_flash_func(pio_usb_ll_configure_endpoint)(
   ep->ep_num = d->epaddr;
   ep->attr = d->attr;
   ep->interval = d->interval;
-  ep->interval_counter = 0;
+  ep->period = 1;
+  ep->phase = 0;
+  ep->iso_packets = NULL;
+  ep->iso_count = 0;
+  ep->nak_policy = PIO_USB_NAK_POLICY_NONE;
+  ep->nak_wait = 0;
   ep->data_id = 0;
+  ep->tx_train = NULL;
+  ep->tx_train_size = 0;
 }
 
-// Encode transfer data to 2bit sequence represents TX PIO instruction address
-uint8_t __no_inline_not_in_flash_func(pio_usb_ll_encode_tx_data)(
-    uint8_t const *buffer, uint8_t buffer_len, uint8_t *encoded_data) {
-  uint16_t bit_idx = 0;
-  int current_state = 1;
-  int bit_stuffing = 6;
-  for (int idx = 0; idx < buffer_len; idx++) {
-    uint8_t data_byte = buffer[idx];
-    for (int b = 0; b < 8; b++) {
-      uint8_t byte_idx = bit_idx >> 2;
-      encoded_data[byte_idx] <<= 2;
-      if (data_byte & (1 << b)) {
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-        }
-        bit_stuffing--;
-      } else {
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-          current_state = 0;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-          current_state = 1;
-        }
-        bit_stuffing = 6;
+// Return true if [offset, offset + size) of arena overlaps a buffer held by
+// an endpoint in the pool
+static bool arena_range_used(uint32_t offset, uint32_t size) {
+  for (int idx = 0; idx < PIO_USB_EP_POOL_CNT; idx++) {
+    endpoint_t const *ep = PIO_USB_ENDPOINT(idx);
+    if (ep->buffer_size == 0) {
+      continue;
+    }
+    uint32_t const start = (uint32_t)(ep->buffer[0] - ep_buffer_arena);
+    if (offset < start + ep->buffer_size && start < offset + size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Allocate buffer of ep sized by ep->size from arena. Buffers are placed into
+// the first free gap at the start of arena or after a buffer held by another
+// endpoint, so space of closed endpoints is reused. tx is false if ep never
+// sends DATA packet.
+bool __no_inline_not_in_flash_func(pio_usb_ll_alloc_buffer)(endpoint_t *ep,
+                                                            bool tx) {
+  uint16_t const slot_size =
+      PIO_USB_TX_TOKEN_ROOM + PIO_USB_TX_ENCODED_LEN(ep->size + 4);
+  uint16_t const size = PIO_USB_EP_BUFFER_SIZE(ep->size, tx);
+
+  ep->buffer[0] = ep->buffer[1] = NULL;
+  ep->buffer_size = 0;
+
+  for (int idx = -1; idx < PIO_USB_EP_POOL_CNT; idx++) {
+    uint32_t offset = 0;
+    if (idx >= 0) {
+      endpoint_t const *other = PIO_USB_ENDPOINT(idx);
+      if (other->buffer_size == 0) {
+        continue;
       }
+      offset = (uint32_t)(other->buffer[0] - ep_buffer_arena) +
+               other->buffer_size;
+    }
+    if (offset + size > ep_buffer_arena_size ||
+        arena_range_used(offset, size)) {
+      continue;
+    }
 
-      bit_idx++;
+    ep->buffer[0] = ep_buffer_arena + offset;
+    ep->buffer[1] =
+        (tx && PIO_USB_TX_SLOT_CNT > 1) ? ep->buffer[0] + slot_size : NULL;
+    ep->buffer_size = size;
+    return true;
+  }
 
-      if (bit_stuffing == 0) {
-        byte_idx = bit_idx >> 2;
-        encoded_data[byte_idx] <<= 2;
+  return false;
+}
 
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-          current_state = 0;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-          current_state = 1;
-        }
-        bit_stuffing = 6;
-        bit_idx++;
+// Return buffer of a closed endpoint to arena
+void pio_usb_ll_free_buffer(endpoint_t *ep) {
+  ep->buffer[0] = ep->buffer[1] = NULL;
+  ep->buffer_size = 0;
+}
+
+// Release buffers of all endpoints, which must not be used afterwards
+void pio_usb_ll_reset_buffers(void) {
+  for (int idx = 0; idx < PIO_USB_EP_POOL_CNT; idx++) {
+    pio_usb_ll_free_buffer(PIO_USB_ENDPOINT(idx));
+  }
+}
+
+#if !PIO_USB_TX_ENCODE_IN_PIO
+// Lookup tables for pio_usb_ll_encode_tx_data(), generated by
+// tools/gen_tx_encode_tbl.py. Symbols are generated for line state 1 and
+// inverted with TX_ENCODE_INV_MASK while line state is 0.
+//
+// tx_encode_byte_tbl[data]: byte without bit stuffing, 0 if data has a run of
+// six 1s. Limit is 6 minus number of 1s from LSB of data.
+//   [15:0]  8 symbols, first transmitted bit (LSB) in [15:14]
+//   [18:16] ones run after this byte
+//   [19]    line state is toggled by this byte
+//   [22:20] usable only if ones run before this byte is less than this value
+//
+// tx_encode_nibble_tbl[run * 16 + data]: nibble with bit stuffing
+//   [9:0]   4 symbols, or 5 symbols if [10] is set
+//   [10]    stuffing bit is inserted
+//   [13:11] ones run after this nibble
+//   [14]    line state is toggled by this nibble
+#define TX_ENCODE_INV_MASK 0xaaaaaaaau
+#define TX_ENCODE_BYTE_FLIP (1u << 19)
+#define TX_ENCODE_NIBBLE_STUFF (1u << 10)
+#define TX_ENCODE_NIBBLE_FLIP (1u << 14)
+
+static const uint32_t __not_in_flash("tx_encode_tbl") tx_encode_byte_tbl[256] = {
+    0x60dddd, 0x587777, 0x68f777, 0x405ddd, 0x68d777, 0x507ddd, 0x60fddd, 0x385777,
+    0x68df77, 0x5075dd, 0x60f5dd, 0x485f77, 0x60d5dd, 0x587f77, 0x68ff77, 0x2055dd,
+    0x68dd77, 0x5077dd, 0x60f7dd, 0x485d77, 0x60d7dd, 0x587d77, 0x68fd77, 0x3057dd,
+    0x60dfdd, 0x587577, 0x68f577, 0x405fdd, 0x68d577, 0x507fdd, 0x60ffdd, 0x185577,
+    0x68ddf7, 0x50775d, 0x60f75d, 0x485df7, 0x60d75d, 0x587df7, 0x68fdf7, 0x30575d,
+    0x60df5d, 0x5875f7, 0x68f5f7, 0x405f5d, 0x68d5f7, 0x507f5d, 0x60ff5d, 0x2855f7,
+    0x60dd5d, 0x5877f7, 0x68f7f7, 0x405d5d, 0x68d7f7, 0x507d5d, 0x60fd5d, 0x3857f7,
+    0x68dff7, 0x50755d, 0x60f55d, 0x485ff7, 0x60d55d, 0x587ff7, 0x68fff7, 0x000000,
+    0x68ddd7, 0x50777d, 0x60f77d, 0x485dd7, 0x60d77d, 0x587dd7, 0x68fdd7, 0x30577d,
+    0x60df7d, 0x5875d7, 0x68f5d7, 0x405f7d, 0x68d5d7, 0x507f7d, 0x60ff7d, 0x2855d7,
+    0x60dd7d, 0x5877d7, 0x68f7d7, 0x405d7d, 0x68d7d7, 0x507d7d, 0x60fd7d, 0x3857d7,
+    0x68dfd7, 0x50757d, 0x60f57d, 0x485fd7, 0x60d57d, 0x587fd7, 0x68ffd7, 0x10557d,
+    0x60ddfd, 0x587757, 0x68f757, 0x405dfd, 0x68d757, 0x507dfd, 0x60fdfd, 0x385757,
+    0x68df57, 0x5075fd, 0x60f5fd, 0x485f57, 0x60d5fd, 0x587f57, 0x68ff57, 0x2055fd,
+    0x68dd57, 0x5077fd, 0x60f7fd, 0x485d57, 0x60d7fd, 0x587d57, 0x68fd57, 0x3057fd,
+    0x60dffd, 0x587557, 0x68f557, 0x405ffd, 0x68d557, 0x507ffd, 0x000000, 0x000000,
+    0x69dddf, 0x517775, 0x61f775, 0x495ddf, 0x61d775, 0x597ddf, 0x69fddf, 0x315775,
+    0x61df75, 0x5975df, 0x69f5df, 0x415f75, 0x69d5df, 0x517f75, 0x61ff75, 0x2955df,
+    0x61dd75, 0x5977df, 0x69f7df, 0x415d75, 0x69d7df, 0x517d75, 0x61fd75, 0x3957df,
+    0x69dfdf, 0x517575, 0x61f575, 0x495fdf, 0x61d575, 0x597fdf, 0x69ffdf, 0x115575,
+    0x61ddf5, 0x59775f, 0x69f75f, 0x415df5, 0x69d75f, 0x517df5, 0x61fdf5, 0x39575f,
+    0x69df5f, 0x5175f5, 0x61f5f5, 0x495f5f, 0x61d5f5, 0x597f5f, 0x69ff5f, 0x2155f5,
+    0x69dd5f, 0x5177f5, 0x61f7f5, 0x495d5f, 0x61d7f5, 0x597d5f, 0x69fd5f, 0x3157f5,
+    0x61dff5, 0x59755f, 0x69f55f, 0x415ff5, 0x69d55f, 0x517ff5, 0x61fff5, 0x000000,
+    0x62ddd5, 0x5a777f, 0x6af77f, 0x425dd5, 0x6ad77f, 0x527dd5, 0x62fdd5, 0x3a577f,
+    0x6adf7f, 0x5275d5, 0x62f5d5, 0x4a5f7f, 0x62d5d5, 0x5a7f7f, 0x6aff7f, 0x2255d5,
+    0x6add7f, 0x5277d5, 0x62f7d5, 0x4a5d7f, 0x62d7d5, 0x5a7d7f, 0x6afd7f, 0x3257d5,
+    0x62dfd5, 0x5a757f, 0x6af57f, 0x425fd5, 0x6ad57f, 0x527fd5, 0x62ffd5, 0x1a557f,
+    0x6bddff, 0x537755, 0x63f755, 0x4b5dff, 0x63d755, 0x5b7dff, 0x6bfdff, 0x335755,
+    0x63df55, 0x5b75ff, 0x6bf5ff, 0x435f55, 0x6bd5ff, 0x537f55, 0x63ff55, 0x2b55ff,
+    0x64dd55, 0x5c77ff, 0x6cf7ff, 0x445d55, 0x6cd7ff, 0x547d55, 0x64fd55, 0x3c57ff,
+    0x6ddfff, 0x557555, 0x65f555, 0x4d5fff, 0x000000, 0x000000, 0x000000, 0x000000,
+};
+
+static const uint16_t __not_in_flash("tx_encode_tbl") tx_encode_nibble_tbl[6 * 16] = {
+    0x00dd, 0x4077, 0x40f7, 0x005d, 0x40d7, 0x007d, 0x00fd, 0x4057,
+    0x48df, 0x0875, 0x08f5, 0x485f, 0x10d5, 0x507f, 0x58ff, 0x2055,
+    0x00dd, 0x4077, 0x40f7, 0x005d, 0x40d7, 0x007d, 0x00fd, 0x4057,
+    0x48df, 0x0875, 0x08f5, 0x485f, 0x10d5, 0x507f, 0x58ff, 0x2855,
+    0x00dd, 0x4077, 0x40f7, 0x005d, 0x40d7, 0x007d, 0x00fd, 0x4057,
+    0x48df, 0x0875, 0x08f5, 0x485f, 0x10d5, 0x507f, 0x58ff, 0x4557,
+    0x00dd, 0x4077, 0x40f7, 0x005d, 0x40d7, 0x007d, 0x00fd, 0x055d,
+    0x48df, 0x0875, 0x08f5, 0x485f, 0x10d5, 0x507f, 0x58ff, 0x4d5f,
+    0x00dd, 0x4077, 0x40f7, 0x4577, 0x40d7, 0x007d, 0x00fd, 0x057d,
+    0x48df, 0x0875, 0x08f5, 0x0d75, 0x10d5, 0x507f, 0x58ff, 0x557f,
+    0x00dd, 0x05dd, 0x40f7, 0x45f7, 0x40d7, 0x45d7, 0x00fd, 0x05fd,
+    0x48df, 0x4ddf, 0x08f5, 0x0df5, 0x10d5, 0x15d5, 0x58ff, 0x5dff,
+};
+
+#endif
+
+// Streaming encoder state. Data is fed byte by byte with tx_encoder_put() so
+// that callers can compute CRC in the same pass.
+typedef struct {
+  uint8_t *start;
+  uint8_t *dst;
+  uint32_t acc;      // pending symbols, latest one at LSB
+  uint32_t acc_bits; // number of pending bits in acc, always < 8 between bytes
+  uint32_t inv;      // TX_ENCODE_INV_MASK while line state is 0
+  uint32_t run;      // number of consecutive 1 bits
+} tx_encoder_t;
+
+#if PIO_USB_TX_ENCODE_IN_PIO
+// TX state machine does NRZI encoding and bit stuffing. Raw packet follows
+// packet length.
+static __always_inline void tx_encoder_init(tx_encoder_t *enc,
+                                            uint8_t *encoded_data) {
+  enc->start = encoded_data;
+  enc->dst = encoded_data + 1;
+}
+
+static __always_inline void tx_encoder_put(tx_encoder_t *enc,
+                                           uint8_t data_byte) {
+  *enc->dst++ = data_byte;
+}
+
+static __always_inline uint16_t tx_encoder_finish(tx_encoder_t *enc) {
+  enc->start[0] = enc->dst - enc->start - 1;
+  return enc->dst - enc->start;
+}
+
+// TX program checks TX FIFO at EOP and goes on to the next packet
+static __always_inline uint16_t tx_encoder_finish_chained(tx_encoder_t *enc) {
+  return tx_encoder_finish(enc);
+}
+#else
+static __always_inline void tx_encoder_init(tx_encoder_t *enc,
+                                            uint8_t *encoded_data) {
+  enc->start = encoded_data;
+  enc->dst = encoded_data;
+  enc->acc = 0;
+  enc->acc_bits = 0;
+  enc->inv = 0;
+  enc->run = 0;
+}
+
+static __always_inline void tx_encoder_put(tx_encoder_t *enc,
+                                           uint8_t data_byte) {
+  uint32_t const e = tx_encode_byte_tbl[data_byte];
+
+  if (enc->run < (e >> 20)) {
+    // fast path: no bit stuffing in this byte
+    enc->acc = (enc->acc << 16) | ((e ^ enc->inv) & 0xffff);
+    *enc->dst++ = enc->acc >> (enc->acc_bits + 8);
+    *enc->dst++ = enc->acc >> enc->acc_bits;
+    enc->run = (e >> 16) & 0x07;
+    if (e & TX_ENCODE_BYTE_FLIP) {
+      enc->inv ^= TX_ENCODE_INV_MASK;
+    }
+  } else {
+    for (int shift = 0; shift < 8; shift += 4) {
+      uint32_t const n =
+          tx_encode_nibble_tbl[enc->run * 16 + ((data_byte >> shift) & 0x0f)];
+      uint32_t const n_bits = (n & TX_ENCODE_NIBBLE_STUFF) ? 10 : 8;
+      enc->acc = (enc->acc << n_bits) | ((n ^ enc->inv) & ((1u << n_bits) - 1));
+      enc->acc_bits += n_bits;
+      enc->run = (n >> 11) & 0x07;
+      if (n & TX_ENCODE_NIBBLE_FLIP) {
+        enc->inv ^= TX_ENCODE_INV_MASK;
       }
     }
+    while (enc->acc_bits >= 8) {
+      enc->acc_bits -= 8;
+      *enc->dst++ = enc->acc >> enc->acc_bits;
+    }
   }
+}
 
-  uint8_t byte_idx = bit_idx >> 2;
-  encoded_data[byte_idx] <<= 2;
-  encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_SE0;
-  bit_idx++;
+// Append EOP, then terminate buffers with K. Returns encoded length.
+static __always_inline uint16_t tx_encoder_finish(tx_encoder_t *enc) {
+  enc->acc = (enc->acc << 4) | (PIO_USB_TX_ENCODED_DATA_SE0 << 2) |
+             PIO_USB_TX_ENCODED_DATA_COMP;
+  enc->acc_bits += 4;
+  do {
+    enc->acc = (enc->acc << 2) | PIO_USB_TX_ENCODED_DATA_K;
+    enc->acc_bits += 2;
+  } while (enc->acc_bits & 0x07);
 
-  byte_idx = bit_idx >> 2;
-  encoded_data[byte_idx] <<= 2;
-  encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_COMP;
-  bit_idx++;
+  while (enc->acc_bits) {
+    enc->acc_bits -= 8;
+    *enc->dst++ = enc->acc >> enc->acc_bits;
+  }
 
-  // terminate buffers with K
+  return enc->dst - enc->start;
+}
+
+// Append SE0 without releasing the bus, then keep J until the next packet.
+// At least one J is put so that inter-packet delay is 2 bit time or longer.
+static __always_inline uint16_t tx_encoder_finish_chained(tx_encoder_t *enc) {
+  enc->acc = (enc->acc << 2) | PIO_USB_TX_ENCODED_DATA_SE0;
+  enc->acc_bits += 2;
   do {
-    byte_idx = bit_idx >> 2;
-    encoded_data[byte_idx] <<= 2;
-    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-    bit_idx++;
-  } while (bit_idx & 0x03);
+    enc->acc = (enc->acc << 2) | PIO_USB_TX_ENCODED_DATA_K;
+    enc->acc_bits += 2;
+  } while (enc->acc_bits & 0x07);
+
+  while (enc->acc_bits) {
+    enc->acc_bits -= 8;
+    *enc->dst++ = enc->acc >> enc->acc_bits;
+  }
 
-  byte_idx = bit_idx >> 2;
-  return byte_idx;
+  return enc->dst - enc->start;
+}
+#endif
+
+// Encode token packet followed by another packet in the same DMA transfer
+static uint8_t __no_inline_not_in_flash_func(encode_chained_token)(
+    uint8_t const *packet, uint8_t *encoded_data) {
+  tx_encoder_t enc;
+  tx_encoder_init(&enc, encoded_data);
+  for (int idx = 0; idx < 4; idx++) {
+    tx_encoder_put(&enc, packet[idx]);
+  }
+  return tx_encoder_finish_chained(&enc);
+}
+
+// Encode transfer data to 2bit sequence represents TX PIO instruction address
+uint8_t __no_inline_not_in_flash_func(pio_usb_ll_encode_tx_data)(
+    uint8_t const *buffer, uint8_t buffer_len, uint8_t *encoded_data) {
+  tx_encoder_t enc;
+  tx_encoder_init(&enc, encoded_data);
+  for (int idx = 0; idx < buffer_len; idx++) {
+    tx_encoder_put(&enc, buffer[idx]);
+  }
+  return tx_encoder_finish(&enc);
 }
 
-static inline __force_inline void prepare_tx_data(endpoint_t *ep) {
-  uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
-  uint8_t buffer[PIO_USB_EP_SIZE + 4];
-  buffer[0] = USB_SYNC;
-  buffer[1] = (ep->data_id == 1) ? USB_PID_DATA1
-                                 : USB_PID_DATA0; // USB_PID_SETUP also DATA0
-  memcpy(buffer + 2, ep->app_buf, xact_len);
+// Encode DATA packet. CRC16 is calculated while encoding, so application
+// buffer is read only once. Slicing-by-4 CRC reads the buffer in advance.
+static inline __force_inline uint16_t encode_data_packet(uint8_t *encoded,
+                                                         uint8_t const *app_buf,
+                                                         uint16_t xact_len,
+                                                         uint8_t data_id) {
+#if PIO_USB_CRC16_TX == PIO_USB_CRC16_SLICE4
+  uint16_t crc16 = calc_usb_crc16_slice4(app_buf, xact_len) ^ 0xffff;
+#else
+  uint16_t crc16 = 0xffff;
+#endif
+  tx_encoder_t enc;
+
+  tx_encoder_init(&enc, encoded);
+  tx_encoder_put(&enc, USB_SYNC);
+  tx_encoder_put(&enc, (data_id == 1)
+                           ? USB_PID_DATA1
+                           : USB_PID_DATA0); // USB_PID_SETUP also DATA0
+  for (uint16_t idx = 0; idx < xact_len; idx++) {
+    uint8_t const data = app_buf[idx];
+#ifdef update_tx_crc16
+    crc16 = update_tx_crc16(crc16, data);
+#endif
+    tx_encoder_put(&enc, data);
+  }
+  crc16 ^= 0xffff;
+  tx_encoder_put(&enc, crc16 & 0xff);
+  tx_encoder_put(&enc, crc16 >> 8);
+
+  return tx_encoder_finish(&enc);
+}
 
-  uint16_t const crc16 = calc_usb_crc16(ep->app_buf, xact_len);
-  buffer[2 + xact_len] = crc16 & 0xff;
-  buffer[2 + xact_len + 1] = crc16 >> 8;
+static inline __force_inline void prepare_tx_data(endpoint_t *ep, uint8_t slot,
+                                                  uint8_t const *app_buf,
+                                                  uint16_t xact_len,
+                                                  uint8_t data_id) {
+  ep->encoded_data_len[slot] =
+      encode_data_packet(ep->buffer[slot] + PIO_USB_TX_TOKEN_ROOM, app_buf,
+                         xact_len, data_id);
+}
 
-  ep->encoded_data_len =
-      pio_usb_ll_encode_tx_data(buffer, xact_len + 4, ep->buffer);
+// Encode isochronous OUT packet into the current buffer slot. Isochronous
+// transfers always use DATA0 at full-speed.
+void __no_inline_not_in_flash_func(pio_usb_ll_prepare_iso_tx)(
+    endpoint_t *ep, uint8_t const *data, uint16_t len) {
+  prepare_tx_data(ep, ep->tx_slot, data, len, 0);
+}
+
+// Encode all packets of the transfer into tx_train. Data toggle of following
+// packets alternates, since a packet is resent until it's acknowledged.
+static bool prepare_tx_train(endpoint_t *ep) {
+  uint16_t const packet_size = PIO_USB_TX_TRAIN_PACKET_SIZE(ep->size);
+  uint16_t offset = 0;
+  uint16_t pos = 0;
+  uint8_t data_id = ep->data_id;
+
+  do {
+    if (pos + packet_size > ep->tx_train_size) {
+      return false;
+    }
+
+    uint16_t const remaining = ep->total_len - offset;
+    uint16_t const xact_len = (remaining < ep->size) ? remaining : ep->size;
+    uint8_t *packet = ep->tx_train + pos;
+    packet[0] = encode_data_packet(packet + 1 + PIO_USB_TX_TOKEN_ROOM,
+                                   ep->app_buf + offset, xact_len, data_id);
+    pos += 1 + PIO_USB_TX_TOKEN_ROOM + packet[0];
+    offset += xact_len;
+    data_id ^= 1;
+  } while (offset < ep->total_len);
+
+  return true;
+}
+
+static inline __force_inline void prepare_current_tx_data(endpoint_t *ep) {
+  prepare_tx_data(ep, ep->tx_slot, ep->app_buf,
+                  pio_usb_ll_get_transaction_len(ep), ep->data_id);
+}
+
+static inline __force_inline void prepare_next_tx_data(endpoint_t *ep) {
+  if (PIO_USB_TX_SLOT_CNT < 2 || ep->tx_next_prepared) {
+    return;
+  }
+
+  // Current packet is not the last one only if it's a full packet
+  uint16_t const next_offset = ep->actual_len + ep->size;
+  if (next_offset >= ep->total_len) {
+    return;
+  }
+
+  uint16_t const remaining = ep->total_len - next_offset;
+  prepare_tx_data(ep, ep->tx_slot ^ 1, ep->app_buf + ep->size,
+                  (remaining < ep->size) ? remaining : ep->size,
+                  ep->data_id ^ 1);
+  ep->tx_next_prepared = true;
+}
+
+// Encode the packet following current one into the other buffer slot, so that
+// it's ready as soon as current one is acknowledged. Call this from the
+// interrupt while waiting for bus e.g. handshake of current packet. Second
+// packet of a transfer is encoded by pio_usb_ll_transfer_start(). No-op
+// without PIO_USB_TX_DOUBLE_BUFFER.
+void __no_inline_not_in_flash_func(pio_usb_ll_prepare_next_tx)(endpoint_t *ep) {
+  if (!ep->is_tx || !ep->has_transfer || ep->tx_train) {
+    return;
+  }
+
+  prepare_next_tx_data(ep);
+}
+
+// Let transfers of ep encode all packets into train when started, so that
+// frame/packet interrupt only sends them. NULL train disables it. Train stores
+// encoded length in a byte, so it's disabled for larger packets.
+void pio_usb_ll_set_tx_train(endpoint_t *ep, uint8_t *train, uint16_t size) {
+  if (PIO_USB_TX_ENCODED_LEN(ep->size + 4) > 0xff) {
+    train = NULL;
+  }
+  ep->tx_train = train;
+  ep->tx_train_size = train ? size : 0;
 }
 
 bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_start)(endpoint_t *ep,
@@ -547,14 +1341,30 @@ bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_start)(endpoint_t *ep,
   if (ep->has_transfer) {
     return false;
   }
+  if (ep->is_tx && !ep->tx_train && !ep->buffer[0]) {
+    return false; // no buffer to encode packet into
+  }
 
   ep->app_buf = buffer;
   ep->total_len = buflen;
   ep->actual_len = 0;
   ep->failed_count = 0;
+  ep->tx_slot = 0;
+  ep->tx_next_prepared = false;
+  ep->tx_train_offset = 0;
+  ep->nak_wait = 0; // new transfer is polled from the next frame
+  ep->nak_resume_frame = 0;
 
   if (ep->is_tx) {
-    prepare_tx_data(ep);
+    if (ep->tx_train) {
+      if (!prepare_tx_train(ep)) {
+        return false;
+      }
+    } else {
+      prepare_current_tx_data(ep);
+      // Before has_transfer is set, so that interrupt doesn't encode it too
+      prepare_next_tx_data(ep);
+    }
   } else {
     ep->new_data_flag = false;
   }
@@ -563,6 +1373,10 @@ bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_start)(endpoint_t *ep,
   ep->transfer_aborted = false;
   ep->has_transfer = true;
 
+  // Frame interrupt clears the bit on completion
+  pio_usb_ll_set_ep_bits(&PIO_USB_ROOT_PORT(ep->root_idx)->ep_active,
+                         PIO_USB_ENDPOINT_MASK(ep));
+
   return true;
 }
 
@@ -578,17 +1392,52 @@ bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_continue)(
     return false;
   } else {
     if (ep->is_tx) {
-      prepare_tx_data(ep);
+      if (ep->tx_train) {
+        ep->tx_train_offset +=
+            1 + PIO_USB_TX_TOKEN_ROOM + ep->tx_train[ep->tx_train_offset];
+      } else if (ep->tx_next_prepared) {
+        ep->tx_slot ^= 1;
+        ep->tx_next_prepared = false;
+      } else {
+        prepare_current_tx_data(ep);
+      }
     }
 
     return true;
   }
 }
 
+// Pre-encode tokens of host endpoint into ep->token_encoded. Address and
+// endpoint number in a token don't change while the endpoint is opened. OUT
+// and SETUP tokens are chained with DATA packet unless PRE is required.
+void pio_usb_ll_encode_token(endpoint_t *ep) {
+  static const uint8_t token_pid[EP_TOKEN_CNT] = {USB_PID_IN, USB_PID_OUT,
+                                                  USB_PID_SETUP};
+  bool const is_control = (ep->ep_num & 0x7f) == 0;
+
+  for (int idx = 0; idx < EP_TOKEN_CNT; idx++) {
+    ep->token_encoded_len[idx] = 0;
+    if (!is_control &&
+        ((idx == EP_TOKEN_SETUP) || ((idx == EP_TOKEN_IN) == ep->is_tx))) {
+      continue;
+    }
+
+    uint8_t packet[4];
+    make_token_packet(packet, token_pid[idx], ep->dev_addr, ep->ep_num);
+    if ((idx == EP_TOKEN_IN) || ep->need_pre) {
+      ep->token_encoded_len[idx] =
+          pio_usb_ll_encode_tx_data(packet, sizeof(packet), ep->token_encoded[idx]);
+    } else {
+      ep->token_encoded_len[idx] =
+          encode_chained_token(packet, ep->token_encoded[idx]);
+    }
+  }
+}
+
 void __no_inline_not_in_flash_func(pio_usb_ll_transfer_complete)(
     endpoint_t *ep, uint32_t flag) {
   root_port_t *rport = PIO_USB_ROOT_PORT(ep->root_idx);
-  uint32_t const ep_mask = (1u << (ep - pio_usb_ep_pool));
+  uint32_t const ep_mask = PIO_USB_ENDPOINT_MASK(ep);
 
   rport->ints |= flag;
 
@@ -605,7 +1454,12 @@ void __no_inline_not_in_flash_func(pio_usb_ll_transfer_complete)(
     // something wrong
   }
 
+  // Bit is cleared before has_transfer is, so that a transfer started right
+  // after it on the other core keeps its bit
+  uint32_t const status = spin_lock_blocking(pio_usb_ep_lock);
+  rport->ep_active &= ~ep_mask;
   ep->has_transfer = false;
+  spin_unlock(pio_usb_ep_lock, status);
 }
 
 int pio_usb_host_add_port(uint8_t pin_dp, PIO_USB_PINOUT pinout) {
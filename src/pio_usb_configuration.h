@@ -19,13 +19,165 @@ typedef struct {
     int8_t debug_pin_eop;
     bool skip_alarm_pool;
     PIO_USB_PINOUT pinout;
+    uint8_t* ep_buffer_arena; // NULL to use built-in arena
+    uint32_t ep_buffer_arena_size;
 } pio_usb_configuration_t;
 
 #ifndef PIO_USB_DP_PIN_DEFAULT
 #define PIO_USB_DP_PIN_DEFAULT 0
 #endif
 
+// Let TX state machine do NRZI encoding and bit stuffing, so that CPU only
+// prepends packet length to raw packet. The TX program takes 27 instructions
+// and doesn't fit in a PIO together with the RX programs, so pio_tx_num should
+// differ from pio_rx_num.
+#ifndef PIO_USB_TX_ENCODE_IN_PIO
+#define PIO_USB_TX_ENCODE_IN_PIO 0
+#endif
+
+// Give TX endpoints a second encoded packet buffer, so that the next packet
+// is encoded by pio_usb_ll_prepare_next_tx() while current one is on the bus.
+// Doubles the endpoint buffer of TX endpoints, see PIO_USB_EP_BUFFER_SIZE().
+#ifndef PIO_USB_TX_DOUBLE_BUFFER
+#define PIO_USB_TX_DOUBLE_BUFFER 0
+#endif
+
+// Where SOF packet for the next frame is encoded
+//   PIO_USB_SOF_ENCODE_IN_IRQ: at the end of the frame interrupt
+//   PIO_USB_SOF_ENCODE_LOOKAHEAD: in pio_usb_host_task(), double buffered.
+//     Application must call pio_usb_host_task() at least once per frame, e.g.
+//     next to tuh_task(). Frame interrupt encodes by itself if the task has
+//     not run in time, which costs as much as PIO_USB_SOF_ENCODE_IN_IRQ.
+//   PIO_USB_SOF_ENCODE_TABLE: all 2048 SOF packets are encoded into a table in
+//     pio_usb_host_init(). Costs 2048 * (PIO_USB_TX_ENCODED_LEN(4) + 1) bytes
+//     of RAM.
+#define PIO_USB_SOF_ENCODE_IN_IRQ 0
+#define PIO_USB_SOF_ENCODE_LOOKAHEAD 1
+#define PIO_USB_SOF_ENCODE_TABLE 2
+#ifndef PIO_USB_SOF_ENCODE
+#define PIO_USB_SOF_ENCODE PIO_USB_SOF_ENCODE_IN_IRQ
+#endif
+
+// Let a DMA channel move received bytes from RX FIFO to buffer. CPU only
+// follows the DMA write pointer to calculate CRC. A free channel is claimed.
+#ifndef PIO_USB_RX_DMA
+#define PIO_USB_RX_DMA 0
+#endif
+
+// Let RX state machine push received bytes by 32-bit word instead of byte.
+// CPU reads RX FIFO once per four bytes. Bits left in ISR at EOP are flushed
+// by padding ISR to a full word.
+#ifndef PIO_USB_RX_WORD_PUSH
+#define PIO_USB_RX_WORD_PUSH 0
+#endif
+
+// CRC16 implementation of each use site. RX updates CRC byte by byte while a
+// packet is arriving. TX can calculate CRC of whole buffer before encoding.
+//   PIO_USB_CRC16_TABLE: 256 entries table in RAM (512 bytes)
+//   PIO_USB_CRC16_NIBBLE: 16 entries table (32 bytes), two lookups per byte
+//   PIO_USB_CRC16_INTERP: 256 entries table. Table address and shift are
+//     calculated by interp1 of the core running USB, so application can't use
+//     it on that core.
+//   PIO_USB_CRC16_SLICE4: four 256 entries tables (2 KB), four bytes per step.
+//     TX only.
+// Cycles per byte over a 64 bytes packet, measured on an x86-64 host and not
+// on RP2040: TABLE 4.4, NIBBLE 11, SLICE4 1.1, INTERP 26. Host has no interp,
+// so the INTERP figure is of the software emulation in test/host. Test 9 of
+// test_ll prints ns per call of calc_usb_crc16*_64 on the target, and cycles
+// per byte is ns * clk_sys MHz / 1000 / 64.
+#define PIO_USB_CRC16_TABLE 0
+#define PIO_USB_CRC16_NIBBLE 1
+#define PIO_USB_CRC16_INTERP 2
+#define PIO_USB_CRC16_SLICE4 3
+#ifndef PIO_USB_CRC16_RX
+#define PIO_USB_CRC16_RX PIO_USB_CRC16_TABLE
+#endif
+#ifndef PIO_USB_CRC16_TX
+#define PIO_USB_CRC16_TX PIO_USB_CRC16_TABLE
+#endif
+
+#if PIO_USB_CRC16_RX == PIO_USB_CRC16_SLICE4
+#error "PIO_USB_CRC16_SLICE4 needs whole buffer and can't be used for RX"
+#endif
+
+// Pre-arm handshake for a DATA packet being received in TX state machine. TX
+// waits for EOP flag of the edge detector and sends the handshake after a
+// fixed turnaround, independent of CPU. Software enables ACK only while
+// received CRC matches, and cancels it otherwise. Requires TX and RX programs
+// in the same PIO, so PIO_USB_TX_ENCODE_IN_PIO can't be used. Packets after
+// PRE fall back to software handshake.
+#ifndef PIO_USB_HANDSHAKE_PREARM
+#define PIO_USB_HANDSHAKE_PREARM 0
+#endif
+
+// Detect RX timeouts by a watchdog state machine in RX PIO instead of polling
+// the timer. Timeouts are counted in bit times and CPU only tests an IRQ flag.
+// The watchdog program needs free instruction memory in RX PIO, so pio_tx_num
+// should differ from pio_rx_num. A free state machine is claimed.
+#ifndef PIO_USB_RX_TIMEOUT_IN_PIO
+#define PIO_USB_RX_TIMEOUT_IN_PIO 0
+#endif
+
+// Let RX decoder check bit stuffing. A packet with stuffing error is dropped
+// as soon as the error is found, without handshake, and counted in
+// rx_bs_err_count of its root port. The decoder is two instructions larger, so
+// pio_tx_num should differ from pio_rx_num.
+#ifndef PIO_USB_RX_BS_ERR_CHECK
+#define PIO_USB_RX_BS_ERR_CHECK 0
+#endif
+
+// Device: keep a DMA control block of the response to IN token (DATA, STALL or
+// NAK) for each endpoint, updated when the endpoint state changes. The IN
+// token handler starts the response by writing the block address to
+// READ_ADDR_TRIG of a control channel, which copies the block to
+// TRANS_COUNT and READ_ADDR_TRIG of the TX channel through an 8 bytes write
+// ring. The last write triggers the TX channel, no CHAIN_TO is used. A free
+// channel is claimed. Stall endpoints with pio_usb_device_endpoint_stall() and
+// pio_usb_device_endpoint_clear_stall(), not by writing ep->stalled.
+#ifndef PIO_USB_DEVICE_IN_PREARM
+#define PIO_USB_DEVICE_IN_PREARM 0
+#endif
+
+// Host: after one transaction per endpoint, keep issuing bulk and control
+// transactions round-robin until this many microseconds after SOF. A
+// transaction is started only if its bus time, estimated from packet length
+// and speed, fits in the rest. Otherwise the endpoint waits for the next frame
+// while shorter transactions of others may still go. An endpoint that NAKs or
+// fails is not polled again in the same frame. Frame interrupt occupies the
+// core up to this long. 0 runs at most one transaction per endpoint per frame.
+#ifndef PIO_USB_HOST_FRAME_BUDGET_US
+#define PIO_USB_HOST_FRAME_BUDGET_US 0
+#endif
+
+#if PIO_USB_HANDSHAKE_PREARM && PIO_USB_TX_ENCODE_IN_PIO
+#error "PIO_USB_HANDSHAKE_PREARM can not be used with PIO_USB_TX_ENCODE_IN_PIO"
+#endif
+
+#if PIO_USB_HANDSHAKE_PREARM && PIO_USB_RX_WORD_PUSH
+#error "PIO_USB_HANDSHAKE_PREARM can not be used with PIO_USB_RX_WORD_PUSH"
+#endif
+
+#if PIO_USB_HANDSHAKE_PREARM && PIO_USB_RX_TIMEOUT_IN_PIO
+#error "PIO_USB_HANDSHAKE_PREARM can not be used with PIO_USB_RX_TIMEOUT_IN_PIO"
+#endif
+
+#if PIO_USB_HANDSHAKE_PREARM && PIO_USB_RX_BS_ERR_CHECK
+#error "PIO_USB_HANDSHAKE_PREARM can not be used with PIO_USB_RX_BS_ERR_CHECK"
+#endif
+
+#if PIO_USB_RX_DMA && PIO_USB_RX_WORD_PUSH
+#error "PIO_USB_RX_WORD_PUSH can not be used with PIO_USB_RX_DMA"
+#endif
+
+#if PIO_USB_HOST_FRAME_BUDGET_US >= 1000
+#error "PIO_USB_HOST_FRAME_BUDGET_US should be less than a frame (1000)"
+#endif
+
+#if PIO_USB_TX_ENCODE_IN_PIO
+#define PIO_USB_TX_DEFAULT 1
+#else
 #define PIO_USB_TX_DEFAULT 0
+#endif
 #define PIO_SM_USB_TX_DEFAULT 0
 #define PIO_USB_DMA_TX_DEFAULT 0
 
@@ -40,7 +192,7 @@ typedef struct {
     PIO_USB_DP_PIN_DEFAULT, PIO_USB_TX_DEFAULT, PIO_SM_USB_TX_DEFAULT,     \
         PIO_USB_DMA_TX_DEFAULT, PIO_USB_RX_DEFAULT, PIO_SM_USB_RX_DEFAULT, \
         PIO_SM_USB_EOP_DEFAULT, NULL, PIO_USB_DEBUG_PIN_NONE,              \
-        PIO_USB_DEBUG_PIN_NONE, false, PIO_USB_PINOUT_DPDM                 \
+        PIO_USB_DEBUG_PIN_NONE, false, PIO_USB_PINOUT_DPDM, NULL, 0        \
   }
 
 #define PIO_USB_EP_POOL_CNT 32
@@ -51,4 +203,14 @@ typedef struct {
 
 #define PIO_USB_EP_SIZE 64
 
+// Built-in arena for endpoint buffers, used unless ep_buffer_arena is given.
+// Default fits all endpoints as TX endpoints of PIO_USB_EP_SIZE, i.e. one
+// encoded packet and token room per endpoint (5472 bytes with CPU encoding).
+// It is twice as large with PIO_USB_TX_DOUBLE_BUFFER. Typical low-speed HID
+// trees need much less, see PIO_USB_EP_BUFFER_SIZE().
+#ifndef PIO_USB_EP_BUFFER_ARENA_SIZE
+#define PIO_USB_EP_BUFFER_ARENA_SIZE \
+  (PIO_USB_EP_POOL_CNT * PIO_USB_EP_BUFFER_SIZE(PIO_USB_EP_SIZE, true))
+#endif
+
 #20251105
@@ -22,13 +22,70 @@
 #include "hardware/irq.h"
 #include "hardware/gpio.h"
 #include "hardware/pio.h"
+#include "hardware/sync.h"
 
 static uint8_t new_devaddr = 0;
 static uint8_t ep0_crc5_lut[16];
 static __unused usb_descriptor_buffers_t descriptor_buffers;
 
-static uint8_t nak_encoded[5];
-static uint8_t stall_encoded[5];
+static uint8_t nak_encoded[PIO_USB_TX_HANDSHAKE_LEN];
+static uint8_t stall_encoded[PIO_USB_TX_HANDSHAKE_LEN];
+
+#if PIO_USB_DEVICE_IN_PREARM
+// Response to IN token of each endpoint. Control channel is triggered by
+// writing its READ_ADDR_TRIG, and copies the block to TRANS_COUNT and
+// READ_ADDR_TRIG of TX channel. Writing the latter starts TX channel.
+typedef struct {
+  uint32_t len;
+  uint32_t data;
+} in_response_t;
+
+static in_response_t in_response[16];
+static uint in_response_ch;
+
+static void configure_in_response_channel(const pio_port_t *pp) {
+  in_response_ch = dma_claim_unused_channel(true);
+  dma_channel_config conf = dma_channel_get_default_config(in_response_ch);
+
+  channel_config_set_read_increment(&conf, true);
+  channel_config_set_write_increment(&conf, true);
+  channel_config_set_transfer_data_size(&conf, DMA_SIZE_32);
+  // al3_transfer_count and al3_read_addr_trig, wrap to write them again
+  channel_config_set_ring(&conf, true, 3);
+
+  dma_channel_configure(in_response_ch, &conf,
+                        &dma_hw->ch[pp->tx_ch].al3_transfer_count, NULL, 2,
+                        false);
+}
+#endif
+
+// Update response to IN token after IN endpoint state is changed
+static void __no_inline_not_in_flash_func(update_in_response)(uint8_t ep_num) {
+#if PIO_USB_DEVICE_IN_PREARM
+  endpoint_t *ep = PIO_USB_ENDPOINT((ep_num << 1) | 0x01);
+  const uint8_t *data;
+  uint32_t len;
+
+  if (ep->has_transfer) {
+    data = pio_usb_ll_get_tx_data(ep);
+    len = pio_usb_ll_get_tx_data_len(ep);
+  } else if (ep->stalled) {
+    data = stall_encoded;
+    len = sizeof(stall_encoded);
+  } else {
+    data = nak_encoded;
+    len = sizeof(nak_encoded);
+  }
+
+  // Packet handler may use it
+  uint32_t status = save_and_disable_interrupts();
+  in_response[ep_num].len = len;
+  in_response[ep_num].data = (uint32_t)(uintptr_t)data;
+  restore_interrupts(status);
+#else
+  (void)ep_num;
+#endif
+}
 
 static void __no_inline_not_in_flash_func(update_ep0_crc5_lut)(uint8_t addr) {
   uint16_t dat;
@@ -42,17 +99,32 @@ static void __no_inline_not_in_flash_func(update_ep0_crc5_lut)(uint8_t addr) {
 }
 
 static __always_inline void restart_usb_receiver(pio_port_t *pp) {
-  pio_sm_exec(pp->pio_usb_rx, pp->sm_rx, pp->rx_reset_instr2);
-  pio_sm_restart(pp->pio_usb_rx, pp->sm_rx);
+  pio_usb_bus_rearm_receive(pp);
   pp->pio_usb_rx->irq = IRQ_RX_ALL_MASK;
 }
 
+#if PIO_USB_RX_WORD_PUSH
+// SYNC, PID, ADDR and ENDP of token packet are received as a word
+static uint32_t token_word;
+#endif
+
 static __always_inline uint8_t device_receive_token(void) {
   pio_port_t *pp = PIO_USB_PIO_PORT(0);
+#if !PIO_USB_RX_WORD_PUSH
   uint8_t idx = 0;
   uint8_t buffer[2];
+#endif
 
   if ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
+#if PIO_USB_RX_WORD_PUSH
+    while (pio_sm_is_rx_fifo_empty(pp->pio_usb_rx, pp->sm_rx)) {
+      if ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) != 0) {
+        return 0; // shorter than token
+      }
+    }
+    token_word = pio_sm_get(pp->pio_usb_rx, pp->sm_rx);
+    return token_word >> 8;
+#else
     while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
       if (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
         buffer[idx++] = pio_sm_get(pp->pio_usb_rx, pp->sm_rx) >> 24;
@@ -61,6 +133,7 @@ static __always_inline uint8_t device_receive_token(void) {
         }
       }
     }
+#endif
   } else {
     // host is probably timeout. Ignore this packets.
     pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
@@ -71,18 +144,29 @@ static __always_inline uint8_t device_receive_token(void) {
 
 static __always_inline int8_t device_receive_ep_address(uint8_t token,
                                                         uint8_t dev_addr) {
-  pio_port_t *pp = PIO_USB_PIO_PORT(0);
-  uint8_t idx = 0;
   uint8_t addr;
   uint8_t ep;
   uint8_t ep_num = 0;
-  uint8_t buffer[3];
   bool match = false;
 
   static uint8_t eplut[2][8] = {{0, 2, 4, 6, 8, 10, 12, 14},
                                 {1, 3, 5, 7, 9, 11, 13, 15}};
   uint8_t *current_lut;
 
+#if PIO_USB_RX_WORD_PUSH
+  // Already received with PID
+  uint8_t const addr_endp = token_word >> 16;
+  if (token != USB_PID_SOF) {
+    addr = addr_endp & 0x7f;
+    current_lut = &eplut[addr_endp >> 7][0];
+    match = dev_addr == addr ? true : false;
+  }
+  ep_num = token_word >> 24;
+#else
+  pio_port_t *pp = PIO_USB_PIO_PORT(0);
+  uint8_t idx = 0;
+  uint8_t buffer[3];
+
   if ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
     while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
       if (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
@@ -101,6 +185,7 @@ static __always_inline int8_t device_receive_ep_address(uint8_t token,
     // host is probably timeout. Ignore this packets.
     pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
   }
+#endif
 
   if (match) {
     ep = current_lut[ep_num & 0x07];
@@ -142,15 +227,23 @@ static void __no_inline_not_in_flash_func(usb_device_packet_handler)(void) {
     endpoint_t *ep = PIO_USB_ENDPOINT((ep_num << 1) | 0x01);
 
     pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
+#if PIO_USB_DEVICE_IN_PREARM
+    dma_hw->ch[in_response_ch].al3_read_addr_trig =
+        (uint32_t)(uintptr_t)&in_response[ep_num];
+    volatile bool has_transfer = ep->has_transfer;
+#else
     volatile bool has_transfer = ep->has_transfer;
 
     if (has_transfer) {
-      dma_channel_transfer_from_buffer_now(pp->tx_ch, ep->buffer, ep->encoded_data_len);
+      dma_channel_transfer_from_buffer_now(
+          pp->tx_ch, pio_usb_ll_get_tx_data(ep),
+          pio_usb_ll_get_tx_data_len(ep));
     } else if (ep->stalled) {
       dma_channel_transfer_from_buffer_now(pp->tx_ch, stall_encoded, sizeof(stall_encoded));
     } else {
       dma_channel_transfer_from_buffer_now(pp->tx_ch, nak_encoded, sizeof(nak_encoded));
     }
+#endif
 
     pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK; // clear complete flag
     while ((pp->pio_usb_tx->irq & IRQ_TX_ALL_MASK) == 0) {
@@ -203,7 +296,15 @@ static void __no_inline_not_in_flash_func(usb_device_packet_handler)(void) {
     uint8_t handshake = ep->stalled
                            ? USB_PID_STALL
                            : (ep->has_transfer ? USB_PID_ACK : USB_PID_NAK);
-    int res = pio_usb_bus_receive_packet_and_handshake(pp, handshake);
+    int res;
+    if (ep->has_transfer) {
+      uint8_t pid;
+      res = pio_usb_bus_receive_data_and_handshake(
+          pp, handshake, ep->app_buf, pio_usb_ll_get_transaction_len(ep),
+          &pid);
+    } else {
+      res = pio_usb_bus_receive_packet_and_handshake(pp, handshake);
+    }
     pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
     restart_usb_receiver(pp);
     pp->pio_usb_rx->irq = IRQ_RX_ALL_MASK;
@@ -211,7 +312,6 @@ static void __no_inline_not_in_flash_func(usb_device_packet_handler)(void) {
 
     if (ep->has_transfer) {
       if (res >= 0) {
-        memcpy(ep->app_buf, pp->usb_rx_buffer + 2, res);
         pio_usb_ll_transfer_continue(ep, res);
       }
     }
@@ -235,6 +335,7 @@ static void __no_inline_not_in_flash_func(usb_device_packet_handler)(void) {
       PIO_USB_ENDPOINT(0)->has_transfer = PIO_USB_ENDPOINT(1)->has_transfer = false;
       PIO_USB_ENDPOINT(0)->data_id = PIO_USB_ENDPOINT(1)->data_id = 1;
       PIO_USB_ENDPOINT(0)->stalled = PIO_USB_ENDPOINT(1)->stalled = false;
+      update_in_response(0);
     }
   } else if (token == USB_PID_SOF) {
     // SOF interrupt
@@ -267,7 +368,7 @@ usb_device_t *pio_usb_device_init(const pio_usb_configuration_t *c,
 
   float const cpu_freq = (float)clock_get_hz(clk_sys);
 
-  pio_calculate_clkdiv_from_float(cpu_freq / 48000000,
+  pio_calculate_clkdiv_from_float(cpu_freq / (12000000 * PIO_USB_TX_CYCLES_PER_BIT),
                                   &pp->clk_div_fs_tx.div_int,
                                   &pp->clk_div_fs_tx.div_frac);
   pio_calculate_clkdiv_from_float(cpu_freq / 96000000,
@@ -302,6 +403,13 @@ usb_device_t *pio_usb_device_init(const pio_usb_configuration_t *c,
   raw_packet[1] = USB_PID_STALL;
   pio_usb_ll_encode_tx_data(raw_packet, 2, stall_encoded);
 
+#if PIO_USB_DEVICE_IN_PREARM
+  configure_in_response_channel(pp);
+  for (uint8_t ep_num = 0; ep_num < 16; ep_num++) {
+    update_in_response(ep_num);
+  }
+#endif
+
   return dev;
 }
 
@@ -318,19 +426,64 @@ bool __no_inline_not_in_flash_func(pio_usb_device_endpoint_open)(
   const endpoint_descriptor_t *d = (const endpoint_descriptor_t *)desc_endpoint;
   endpoint_t *ep = pio_usb_device_get_endpoint_by_address(d->epaddr);
 
+  // endpoint is re-opened at every SET_CONFIGURATION
+  pio_usb_ll_free_buffer(ep);
   pio_usb_ll_configure_endpoint(ep, desc_endpoint);
   ep->root_idx = 0;
   ep->dev_addr = 0; // not used
   ep->need_pre = 0;
   ep->is_tx = (d->epaddr & 0x80) ? true : false; // device: endpoint in is tx
 
+  if (!pio_usb_ll_alloc_buffer(ep, ep->is_tx)) {
+    ep->size = 0;
+    return false;
+  }
+
   return true;
 }
 
 bool pio_usb_device_transfer(uint8_t ep_address, uint8_t *buffer,
                              uint16_t buflen) {
   endpoint_t *ep = pio_usb_device_get_endpoint_by_address(ep_address);
-  return pio_usb_ll_transfer_start(ep, buffer, buflen);
+  if (!pio_usb_ll_transfer_start(ep, buffer, buflen)) {
+    return false;
+  }
+  if (ep->is_tx) {
+    update_in_response(ep_address & 0x0f);
+  }
+  return true;
+}
+
+// Stall and clear stall go through these, so that pre-armed IN response
+// follows the endpoint state
+void pio_usb_device_endpoint_stall(uint8_t ep_address) {
+  endpoint_t *ep = pio_usb_device_get_endpoint_by_address(ep_address);
+  ep->stalled = true;
+  if (ep->is_tx) {
+    update_in_response(ep_address & 0x0f);
+  }
+}
+
+void pio_usb_device_endpoint_clear_stall(uint8_t ep_address) {
+  endpoint_t *ep = pio_usb_device_get_endpoint_by_address(ep_address);
+  ep->data_id = 0;
+  ep->stalled = false;
+  if (ep->is_tx) {
+    update_in_response(ep_address & 0x0f);
+  }
+}
+
+// Opt-in: IN transfers of the endpoint are encoded into train buffer in
+// caller context. Size it with PIO_USB_TX_TRAIN_SIZE().
+bool pio_usb_device_endpoint_set_tx_train(uint8_t ep_address, uint8_t *train,
+                                          uint16_t size) {
+  endpoint_t *ep = pio_usb_device_get_endpoint_by_address(ep_address);
+  if (ep->has_transfer) {
+    return false;
+  }
+
+  pio_usb_ll_set_tx_train(ep, train, size);
+  return true;
 }
 
 //--------------------------------------------------------------------+
@@ -346,6 +499,7 @@ static void __no_inline_not_in_flash_func(prepare_ep0_data)(uint8_t *data,
   endpoint_t *ep = &pio_usb_ep_pool[1];
 
   pio_usb_ll_transfer_start(ep, data, len);
+  update_in_response(0);
 
   if (len) {
     // there is data, prepare for status as well
@@ -363,6 +517,7 @@ static void __no_inline_not_in_flash_func(prepare_ep0_rx)(uint8_t *data,
   if (len) {
     // there is data, prepare for status as well
     pio_usb_ll_transfer_start(&pio_usb_ep_pool[1], NULL, 0);
+    update_in_response(0);
   }
 }
 
@@ -418,8 +573,19 @@ void pio_usb_device_task(void) {
       PIO_USB_ENDPOINT(1)->ep_num = 0x80;
       PIO_USB_ENDPOINT(1)->is_tx = true;
 
+      // Endpoints are reallocated after reset. Control endpoint stalls and
+      // its transfers fail if arena is too small.
+      pio_usb_ll_reset_buffers();
+      if (!pio_usb_ll_alloc_buffer(PIO_USB_ENDPOINT(0), false) ||
+          !pio_usb_ll_alloc_buffer(PIO_USB_ENDPOINT(1), true)) {
+        PIO_USB_ENDPOINT(0)->stalled = PIO_USB_ENDPOINT(1)->stalled = true;
+      }
+
       // TODO should be reset end, this is reset start only
       rport->ep_complete = rport->ep_stalled = rport->ep_error = 0;
+      for (uint8_t ep_num = 0; ep_num < 16; ep_num++) {
+        update_in_response(ep_num);
+      }
       rport->ints |= PIO_USB_INTS_RESET_END_BITS;
       reset = true;
     }
@@ -554,7 +720,11 @@ static void __no_inline_not_in_flash_func(__pio_usb_device_irq_handler)(uint8_t
       if (root->ep_continue & (1 << b)) {
         endpoint_t *ep = PIO_USB_ENDPOINT((b << 1) | 0x01);
         uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
-        pio_usb_ll_transfer_continue(ep, xact_len);
+        if (pio_usb_ll_transfer_continue(ep, xact_len)) {
+          // Packet after next is encoded while next one waits for IN token
+          pio_usb_ll_prepare_next_tx(ep);
+        }
+        update_in_response(b);
         root->ep_continue &= ~(1 << b);
       }
     }
@@ -21,6 +21,11 @@
 
 enum {
   TRANSACTION_MAX_RETRY = 3, // Number of times to retry a failed transaction
+  TOKEN_BITS = 35,           // SYNC, PID, ADDR, ENDP, CRC5 and EOP
+  HANDSHAKE_BITS = 19,       // SYNC, PID and EOP
+  TURNAROUND_BITS = 18,      // Maximum inter-packet delay and bus turnaround
+  PRE_BITS = 20,             // PRE packet and hub setup, at full-speed
+  PERIODIC_FRAMES = 32,      // Longest period of interrupt endpoint schedule
 };
 
 static alarm_pool_t *_alarm_pool = NULL;
@@ -32,13 +37,47 @@ static bool timer_active;
 static volatile bool cancel_timer_flag;
 static volatile bool start_timer_flag;
 static __unused uint32_t int_stat;
-static uint8_t sof_packet[4] = {USB_SYNC, USB_PID_SOF, 0x00, 0x10};
-static uint8_t sof_packet_encoded[4 * 2 * 7 / 6 + 2];
-static uint8_t sof_packet_encoded_len;
 static uint8_t keepalive_encoded[1];
 
+typedef struct {
+  uint8_t len;
+  uint8_t data[PIO_USB_TX_ENCODED_LEN(4)];
+} sof_encoded_t;
+
+#if PIO_USB_SOF_ENCODE == PIO_USB_SOF_ENCODE_TABLE
+#define SOF_ENCODED_CNT 2048
+#elif PIO_USB_SOF_ENCODE == PIO_USB_SOF_ENCODE_LOOKAHEAD
+#define SOF_ENCODED_CNT 2
+#else
+#define SOF_ENCODED_CNT 1
+#endif
+#define SOF_ENCODED(frame) (&sof_encoded[(frame) % SOF_ENCODED_CNT])
+
+static sof_encoded_t sof_encoded[SOF_ENCODED_CNT];
+// Frame number whose SOF is ready in SOF_ENCODED(frame)
+static __unused volatile uint32_t sof_encoded_frame;
+
 static bool sof_timer(repeating_timer_t *_rt);
 
+// Pre-encoded tokens of endpoint pool, only referenced by host functions so
+// that device-only builds don't link them
+static uint8_t token_encoded[PIO_USB_EP_POOL_CNT][EP_TOKEN_CNT]
+                            [PIO_USB_TX_TOKEN_ROOM];
+
+// Bus time reserved by interrupt endpoints in each frame of schedule tree,
+// shared by all root ports since they are serviced in one frame interrupt
+static uint16_t periodic_load_us[PERIODIC_FRAMES];
+
+static void __not_in_flash_func(encode_sof)(uint32_t frame,
+                                            sof_encoded_t *sof) {
+  // SOF counter is 11-bit
+  uint16_t const frame_11b = frame & 0x7ff;
+  uint8_t const packet[4] = {
+      USB_SYNC, USB_PID_SOF, frame_11b & 0xff,
+      (calc_usb_crc5(frame_11b) << 3) | (frame_11b >> 8)};
+  sof->len = pio_usb_ll_encode_tx_data(packet, sizeof(packet), sof->data);
+}
+
 //--------------------------------------------------------------------+
 // Application API
 //--------------------------------------------------------------------+
@@ -69,10 +108,10 @@ usb_device_t *pio_usb_host_init(const pio_usb_configuration_t *c) {
   root->mode = PIO_USB_MODE_HOST;
 
   float const cpu_freq = (float)clock_get_hz(clk_sys);
-  pio_calculate_clkdiv_from_float(cpu_freq / 48000000,
+  pio_calculate_clkdiv_from_float(cpu_freq / (12000000 * PIO_USB_TX_CYCLES_PER_BIT),
                                   &pp->clk_div_fs_tx.div_int,
                                   &pp->clk_div_fs_tx.div_frac);
-  pio_calculate_clkdiv_from_float(cpu_freq / 6000000,
+  pio_calculate_clkdiv_from_float(cpu_freq / (1500000 * PIO_USB_TX_CYCLES_PER_BIT),
                                   &pp->clk_div_ls_tx.div_int,
                                   &pp->clk_div_ls_tx.div_frac);
 
@@ -83,8 +122,14 @@ usb_device_t *pio_usb_host_init(const pio_usb_configuration_t *c) {
                                   &pp->clk_div_ls_rx.div_int,
                                   &pp->clk_div_ls_rx.div_frac);
 
-  sof_packet_encoded_len =
-      pio_usb_ll_encode_tx_data(sof_packet, sizeof(sof_packet), sof_packet_encoded);
+#if PIO_USB_SOF_ENCODE == PIO_USB_SOF_ENCODE_TABLE
+  for (uint32_t frame = 0; frame < SOF_ENCODED_CNT; frame++) {
+    encode_sof(frame, SOF_ENCODED(frame));
+  }
+#else
+  encode_sof(sof_count, SOF_ENCODED(sof_count));
+  sof_encoded_frame = sof_count;
+#endif
   pio_usb_ll_encode_tx_data(NULL, 0, keepalive_encoded);
 
   if (!c->skip_alarm_pool) {
@@ -140,13 +185,25 @@ static void
 __no_inline_not_in_flash_func(configure_tx_program)(pio_port_t *pp,
                                                     root_port_t *port) {
   if (port->pinout == PIO_USB_PINOUT_DPDM) {
+#if PIO_USB_TX_ENCODE_IN_PIO
+    pp->fs_tx_program = &usb_tx_nrzi_dpdm_program;
+    pp->fs_tx_pre_program = &usb_tx_nrzi_pre_dpdm_program;
+    pp->ls_tx_program = &usb_tx_nrzi_dmdp_program;
+#else
     pp->fs_tx_program = &usb_tx_dpdm_program;
     pp->fs_tx_pre_program = &usb_tx_pre_dpdm_program;
     pp->ls_tx_program = &usb_tx_dmdp_program;
+#endif
   } else {
+#if PIO_USB_TX_ENCODE_IN_PIO
+    pp->fs_tx_program = &usb_tx_nrzi_dmdp_program;
+    pp->fs_tx_pre_program = &usb_tx_nrzi_pre_dmdp_program;
+    pp->ls_tx_program = &usb_tx_nrzi_dpdm_program;
+#else
     pp->fs_tx_program = &usb_tx_dmdp_program;
     pp->fs_tx_pre_program = &usb_tx_pre_dmdp_program;
     pp->ls_tx_program = &usb_tx_dpdm_program;
+#endif
   }
 }
 
@@ -188,6 +245,7 @@ static void __no_inline_not_in_flash_func(configure_lowspeed_host)(
 
 static void __no_inline_not_in_flash_func(configure_root_port)(
     pio_port_t *pp, root_port_t *root) {
+  pp->root = root;
   if (root->is_fullspeed) {
     configure_fullspeed_host(pp, root);
   } else {
@@ -232,12 +290,20 @@ static bool __no_inline_not_in_flash_func(connection_check)(root_port_t *port) {
 
       // failed/retired all queuing transfer in this root
       uint8_t root_idx = port - PIO_USB_ROOT_PORT(0);
-      for (int ep_idx = 0; ep_idx < PIO_USB_EP_POOL_CNT; ep_idx++) {
-        endpoint_t *ep = PIO_USB_ENDPOINT(ep_idx);
+      uint32_t active = port->ep_active;
+      uint32_t idle = 0;
+      while (active) {
+        int const ep_pool_idx = __builtin_ctz(active);
+        endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
+        active &= active - 1;
         if ((ep->root_idx == root_idx) && ep->size && ep->has_transfer) {
           pio_usb_ll_transfer_complete(ep, PIO_USB_INTS_ENDPOINT_ERROR_BITS);
+        } else {
+          idle |= 1u << ep_pool_idx;
         }
       }
+      // Completed ones are cleared already, and may have been restarted
+      pio_usb_ll_clear_ep_bits(&port->ep_active, idle);
 
       return false;
     }
@@ -252,13 +318,155 @@ static bool __no_inline_not_in_flash_func(connection_check)(root_port_t *port) {
 static int usb_setup_transaction(pio_port_t *pp, endpoint_t *ep);
 static int usb_in_transaction(pio_port_t *pp, endpoint_t *ep);
 static int usb_out_transaction(pio_port_t *pp, endpoint_t *ep);
+static int usb_iso_transaction(pio_port_t *pp, endpoint_t *ep);
+
+// Ring index of isochronous packet of a scheduled frame. It follows frame
+// number, so frames missed by interrupt don't shift the ring.
+static __always_inline uint16_t iso_packet_index(const endpoint_t *ep,
+                                                 uint32_t frame) {
+  return ((frame - ep->iso_start_frame) / ep->period) % ep->iso_count;
+}
+
+// Carry out one transaction of ep. Returns true if it made progress, i.e. the
+// endpoint is worth another transaction in this frame.
+static bool __no_inline_not_in_flash_func(endpoint_transaction)(
+    pio_port_t *pp, endpoint_t *ep) {
+  uint8_t const data_id = ep->data_id;
+  ep->transfer_started = true;
+
+  if (ep->need_pre) {
+    pp->need_pre = true;
+  }
+
+  if ((ep->attr & 0x03) == EP_ATTR_ISOCHRONOUS) {
+    usb_iso_transaction(pp, ep);
+  } else if (ep->ep_num == 0 && ep->data_id == USB_PID_SETUP) {
+    usb_setup_transaction(pp, ep);
+  } else if (ep->ep_num & EP_IN) {
+    usb_in_transaction(pp, ep);
+  } else {
+    usb_out_transaction(pp, ep);
+  }
+
+  if (ep->need_pre) {
+    pp->need_pre = false;
+    restore_fs_bus(pp);
+  }
+
+  ep->transfer_started = false;
+
+  // Data toggle flips on every acknowledged data packet
+  return ep->has_transfer && ep->data_id != data_id;
+}
+
+// Bit times of a transaction with len bytes payload. Data packet is counted
+// with worst case bit stuffing.
+static __always_inline uint32_t transaction_bits(uint16_t len) {
+  // SYNC, PID, CRC16 and EOP around payload
+  uint32_t const data_bits = ((len + 4) * 8 * 7 + 5) / 6 + 3;
+  return TOKEN_BITS + data_bits + HANDSHAKE_BITS + 2 * TURNAROUND_BITS;
+}
+
+// Estimated bus time of a transaction with len bytes payload in microseconds
+static __always_inline uint32_t transaction_time_us(const endpoint_t *ep,
+                                                    uint16_t len,
+                                                    bool low_speed) {
+  uint32_t const bits = transaction_bits(len);
+
+  if (ep->need_pre) {
+    // Low-speed packets and PRE before each packet sent by host
+    return (bits * 8 + 2 * PRE_BITS + 11) / 12;
+  } else if (low_speed) {
+    return (bits * 8 + 11) / 12;
+  }
+  return (bits + 11) / 12;
+}
+
+#if PIO_USB_HOST_FRAME_BUDGET_US
+// Estimated bus time of next transaction of ep
+static __always_inline uint32_t next_transaction_time_us(const pio_port_t *pp,
+                                                         endpoint_t *ep) {
+  uint16_t const len = (ep->data_id == USB_PID_SETUP)
+                           ? 8
+                           : pio_usb_ll_get_transaction_len(ep);
+  return transaction_time_us(ep, len, pp->low_speed);
+}
+
+// Whether next transaction of ep fits in frame budget, elapsed us after frame
+// start. Returns 1 if it fits, 0 if ep should be skipped, and -1 if no
+// transaction fits any more.
+static __always_inline int frame_budget_fit(const pio_port_t *pp,
+                                            endpoint_t *ep, uint32_t elapsed) {
+  // Zero-length packet at full-speed
+  uint32_t const min_time_us = (transaction_bits(0) + 11) / 12;
+
+  if (elapsed + min_time_us > PIO_USB_HOST_FRAME_BUDGET_US) {
+    return -1;
+  }
+  if (elapsed + next_transaction_time_us(pp, ep) >
+      PIO_USB_HOST_FRAME_BUDGET_US) {
+    return 0;
+  }
+  return 1;
+}
+
+// Issue bulk and control transactions round-robin across endpoints in ready
+// bitmap, until they are all idle or frame budget is exhausted. Endpoint whose
+// transaction doesn't fit in the rest is skipped, so a shorter one can go.
+static void __no_inline_not_in_flash_func(run_frame_budget)(
+    pio_port_t *pp, uint32_t frame_start, uint32_t ready) {
+  // Rotate first endpoint of each pass by frame
+  uint32_t const first_mask = ~0u << (sof_count % PIO_USB_EP_POOL_CNT);
+
+  while (ready) {
+    uint32_t next = 0;
+    for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
+      root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
+      uint32_t const pass = ready & root->ep_active;
+      if (!(pass && root->initialized && root->connected && !root->suspended)) {
+        continue;
+      }
+
+      configure_root_port(pp, root);
+      uint32_t order[2] = {pass & first_mask, pass & ~first_mask};
+      for (int half = 0; half < 2; half++) {
+        while (order[half]) {
+          int const ep_pool_idx = __builtin_ctz(order[half]);
+          order[half] &= order[half] - 1;
+          endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
+          if (!ep->has_transfer || ep->transfer_aborted) {
+            continue;
+          }
+
+          int const fit =
+              frame_budget_fit(pp, ep, get_time_us_32() - frame_start);
+          if (fit < 0) {
+            return; // no transaction fits any more
+          } else if (fit == 0) {
+            continue;
+          }
+
+          if (endpoint_transaction(pp, ep)) {
+            next |= 1u << ep_pool_idx;
+          }
+        }
+      }
+    }
+    ready = next;
+  }
+}
+#endif
 
 void __not_in_flash_func(pio_usb_host_frame)(void) {
   if (!timer_active) {
     return;
   }
 
+#if PIO_USB_HOST_FRAME_BUDGET_US
+  uint32_t const frame_start = get_time_us_32();
+#endif
   pio_port_t *pp = PIO_USB_PIO_PORT(0);
+  sof_encoded_t *sof = SOF_ENCODED(sof_count);
 
   // Send SOF
   for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
@@ -270,7 +478,7 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
     configure_root_port(pp, root);
     if (root->is_fullspeed) {
       // Send SOF for full speed
-      pio_usb_bus_usb_transfer(pp, sof_packet_encoded, sof_packet_encoded_len);
+      pio_usb_bus_usb_transfer(pp, sof->data, sof->len);
     } else {
       // Send Keep alive for low speed
       pio_usb_bus_usb_transfer(pp, keepalive_encoded, 1);
@@ -278,57 +486,50 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
   }
 
   // Carry out all queued endpoint transaction
+  // Bulk and control endpoints which made progress
+  uint32_t ready = 0;
   for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
     root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
-    if (!(root->initialized && root->connected && !root->suspended)) {
+    uint32_t pending = root->ep_active;
+    uint32_t const periodic = root->ep_periodic;
+    if (!(pending && root->initialized && root->connected &&
+          !root->suspended)) {
       continue;
     }
 
     configure_root_port(pp, root);
 
-    for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT;
-         ep_pool_idx++) {
+    while (pending) {
+      int const ep_pool_idx = __builtin_ctz(pending);
+      pending &= pending - 1;
       endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
       if ((ep->root_idx == root_idx) && ep->size) {
-        bool const is_periodic = ((ep->attr & 0x03) == EP_ATTR_INTERRUPT);
+        bool const is_periodic = periodic & (1u << ep_pool_idx);
 
-        if (is_periodic && (ep->interval_counter > 0)) {
-          ep->interval_counter--;
+        if (is_periodic && ((sof_count & (ep->period - 1)) != ep->phase)) {
           continue;
         }
 
-        if (ep->has_transfer && !ep->transfer_aborted) {
-          ep->transfer_started = true;
-
-          if (ep->need_pre) {
-            pp->need_pre = true;
-          }
-
-          if (ep->ep_num == 0 && ep->data_id == USB_PID_SETUP) {
-            usb_setup_transaction(pp, ep);
-          } else {
-            if (ep->ep_num & EP_IN) {
-              usb_in_transaction(pp, ep);
-            } else {
-              usb_out_transaction(pp, ep);
-            }
+        if (ep->nak_wait &&
+            (int16_t)((uint16_t)sof_count - ep->nak_resume_frame) < 0) {
+          continue;
+        }
 
-            if (is_periodic) {
-              ep->interval_counter = ep->interval - 1;
-            }
-          }
+        if (ep->has_transfer && !ep->transfer_aborted) {
+          bool const progress = endpoint_transaction(pp, ep);
 
-          if (ep->need_pre) {
-            pp->need_pre = false;
-            restore_fs_bus(pp);
+          if (!is_periodic && progress) {
+            ready |= 1u << ep_pool_idx;
           }
-
-          ep->transfer_started = false;
         }
       }
     }
   }
 
+#if PIO_USB_HOST_FRAME_BUDGET_US
+  run_frame_budget(pp, frame_start, ready);
+#endif
+
   // check for new connection to root hub
   for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
     root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
@@ -352,12 +553,68 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
 
   sof_count++;
 
-  // SOF counter is 11-bit
-  uint16_t const sof_count_11b = sof_count & 0x7ff;
-  sof_packet[2] = sof_count_11b & 0xff;
-  sof_packet[3] = (calc_usb_crc5(sof_count_11b) << 3) | (sof_count_11b >> 8);
-  sof_packet_encoded_len =
-      pio_usb_ll_encode_tx_data(sof_packet, sizeof(sof_packet), sof_packet_encoded);
+#if PIO_USB_SOF_ENCODE != PIO_USB_SOF_ENCODE_TABLE
+  if (sof_encoded_frame != sof_count) {
+    encode_sof(sof_count, SOF_ENCODED(sof_count));
+    sof_encoded_frame = sof_count;
+  }
+#endif
+}
+
+// Encode isochronous OUT packet of the next scheduled frame, so that frame
+// interrupt only sends it
+static void prepare_iso_out(void) {
+  uint32_t const frame = sof_count;
+
+  for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
+    root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
+    uint32_t pending = root->ep_active & root->ep_periodic;
+    while (pending) {
+      endpoint_t *ep = PIO_USB_ENDPOINT(__builtin_ctz(pending));
+      pending &= pending - 1;
+      if ((ep->attr & 0x03) != EP_ATTR_ISOCHRONOUS || (ep->ep_num & EP_IN) ||
+          !ep->has_transfer || ep->tx_next_prepared) {
+        continue;
+      }
+
+      uint32_t const next = frame + ((ep->phase - frame) & (ep->period - 1));
+      uint16_t const idx = iso_packet_index(ep, next);
+      pio_usb_iso_packet_t const *packet = &ep->iso_packets[idx];
+      if (packet->status != PIO_USB_ISO_READY) {
+        continue;
+      }
+
+      uint16_t const len =
+          (packet->length < ep->size) ? packet->length : ep->size;
+      pio_usb_ll_prepare_iso_tx(ep, ep->app_buf + idx * ep->size, len);
+      ep->iso_prepared_frame = next;
+      __compiler_memory_barrier();
+      ep->tx_next_prepared = true; // frame interrupt may run on other core
+    }
+  }
+}
+
+void pio_usb_host_task(void) {
+  prepare_iso_out();
+
+#if PIO_USB_SOF_ENCODE == PIO_USB_SOF_ENCODE_LOOKAHEAD
+  // Encode SOF for the next frame so that frame interrupt only sends it
+  uint32_t const next_frame = sof_count + 1;
+  if (sof_encoded_frame == next_frame) {
+    return;
+  }
+
+  sof_encoded_t sof;
+  encode_sof(next_frame, &sof);
+
+  uint32_t const status = save_and_disable_interrupts();
+  // Frame interrupt may have advanced and encoded SOF meanwhile
+  if (sof_count + 1 == next_frame) {
+    *SOF_ENCODED(next_frame) = sof;
+    sof_encoded_frame = next_frame;
+  }
+  restore_interrupts(status);
+#endif
 }
 
 static bool __no_inline_not_in_flash_func(sof_timer)(repeating_timer_t *_rt) {
@@ -403,13 +660,69 @@ void pio_usb_host_port_reset_end(uint8_t root_idx) {
   root->suspended = false;
 }
 
+// Remove ep from bitmaps of its root port
+static void unschedule_endpoint(endpoint_t *ep) {
+  root_port_t *root = PIO_USB_ROOT_PORT(ep->root_idx);
+  uint32_t const ep_mask = PIO_USB_ENDPOINT_MASK(ep);
+
+  if (root->ep_periodic & ep_mask) {
+    for (uint f = ep->phase; f < PERIODIC_FRAMES; f += ep->period) {
+      periodic_load_us[f] -= ep->periodic_time_us;
+    }
+  }
+
+  pio_usb_ll_clear_ep_bits(&root->ep_active, ep_mask);
+  pio_usb_ll_clear_ep_bits(&root->ep_periodic, ep_mask);
+}
+
+// Place interrupt or isochronous endpoint in the schedule tree. Period is
+// bInterval rounded down to a power of two, or 2^(bInterval-1) for
+// isochronous, and phase is the one whose busiest frame has the least bus
+// time reserved.
+static void schedule_periodic_endpoint(endpoint_t *ep, bool low_speed) {
+  uint8_t period = 1;
+  if ((ep->attr & 0x03) == EP_ATTR_ISOCHRONOUS) {
+    for (uint8_t i = 1; i < ep->interval && period < PERIODIC_FRAMES; i++) {
+      period *= 2;
+    }
+  } else {
+    while (period * 2 <= ep->interval && period * 2 <= PERIODIC_FRAMES) {
+      period *= 2;
+    }
+  }
+
+  uint32_t best_load = UINT32_MAX;
+  uint8_t best_phase = 0;
+  for (uint8_t phase = 0; phase < period; phase++) {
+    uint32_t load = 0;
+    for (uint f = phase; f < PERIODIC_FRAMES; f += period) {
+      if (periodic_load_us[f] > load) {
+        load = periodic_load_us[f];
+      }
+    }
+    if (load < best_load) {
+      best_load = load;
+      best_phase = phase;
+    }
+  }
+
+  ep->period = period;
+  ep->phase = best_phase;
+  ep->periodic_time_us = transaction_time_us(ep, ep->size, low_speed);
+  for (uint f = best_phase; f < PERIODIC_FRAMES; f += period) {
+    periodic_load_us[f] += ep->periodic_time_us;
+  }
+}
+
 void pio_usb_host_close_device(uint8_t root_idx, uint8_t device_address) {
   for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT; ep_pool_idx++) {
     endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
     if ((ep->root_idx == root_idx) && (ep->dev_addr == device_address) &&
         ep->size) {
       ep->size = 0;
+      unschedule_endpoint(ep);
       ep->has_transfer = false;
+      pio_usb_ll_free_buffer(ep);
     }
   }
 }
@@ -436,6 +749,17 @@ bool pio_usb_host_endpoint_open(uint8_t root_idx, uint8_t device_address,
   if (NULL != _find_ep(root_idx, device_address, d->epaddr)) {
     return true; // already opened
   }
+
+  uint16_t const max_size = (d->max_size[0] | (d->max_size[1] << 8)) & 0x7ff;
+  uint16_t const max_payload = (d->epaddr & 0x80) ? PIO_USB_RX_MAX_PAYLOAD
+                                                  : PIO_USB_TX_MAX_PAYLOAD;
+  if (max_size > max_payload) {
+    return false;
+  }
+  if ((d->attr & 0x03) == EP_ATTR_ISOCHRONOUS &&
+      (need_pre || !PIO_USB_ROOT_PORT(root_idx)->is_fullspeed)) {
+    return false; // no isochronous transfer at low-speed
+  }
   for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT; ep_pool_idx++) {
     endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
     // ep size is used as valid indicator
@@ -445,6 +769,19 @@ bool pio_usb_host_endpoint_open(uint8_t root_idx, uint8_t device_address,
       ep->dev_addr = device_address;
       ep->need_pre = need_pre;
       ep->is_tx = (d->epaddr & 0x80) ? false : true; // host endpoint out is tx
+      // control endpoint switches direction
+      if (!pio_usb_ll_alloc_buffer(ep, ep->is_tx || (d->epaddr & 0x7f) == 0)) {
+        ep->size = 0;
+        return false;
+      }
+      ep->token_encoded = token_encoded[ep_pool_idx];
+      pio_usb_ll_encode_token(ep);
+      if ((d->attr & 0x03) == EP_ATTR_INTERRUPT ||
+          (d->attr & 0x03) == EP_ATTR_ISOCHRONOUS) {
+        root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
+        schedule_periodic_endpoint(ep, !root->is_fullspeed);
+        pio_usb_ll_set_ep_bits(&root->ep_periodic, PIO_USB_ENDPOINT_MASK(ep));
+      }
       return true;
     }
   }
@@ -460,6 +797,8 @@ bool pio_usb_host_endpoint_close(uint8_t root_idx, uint8_t device_address,
   }
 
   ep->size = 0; // mark as closed
+  unschedule_endpoint(ep);
+  pio_usb_ll_free_buffer(ep);
   return true;
 }
 
@@ -498,6 +837,73 @@ bool pio_usb_host_endpoint_transfer(uint8_t root_idx, uint8_t device_address,
   return pio_usb_ll_transfer_start(ep, buffer, buflen);
 }
 
+// Opt-in: OUT transfers of the endpoint are encoded into train buffer in
+// caller context. Size it with PIO_USB_TX_TRAIN_SIZE().
+bool pio_usb_host_endpoint_set_tx_train(uint8_t root_idx,
+                                        uint8_t device_address,
+                                        uint8_t ep_address, uint8_t *train,
+                                        uint16_t size) {
+  endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
+  if (!ep || ep->has_transfer) {
+    return false;
+  }
+
+  pio_usb_ll_set_tx_train(ep, train, size);
+  return true;
+}
+
+// Start streaming of isochronous endpoint. Packet i of packets uses buffer +
+// i * wMaxPacketSize and is transferred in i-th scheduled frame of the ring,
+// if it's READY. OUT packets are encoded by pio_usb_host_task(), which should
+// run between scheduled frames; packet not encoded in time is ERROR. Stop with
+// pio_usb_host_endpoint_abort_transfer().
+bool pio_usb_host_endpoint_iso_start(uint8_t root_idx, uint8_t device_address,
+                                     uint8_t ep_address,
+                                     pio_usb_iso_packet_t *packets,
+                                     uint8_t *buffer, uint16_t count) {
+  endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
+  if (!ep || (ep->attr & 0x03) != EP_ATTR_ISOCHRONOUS || ep->has_transfer ||
+      ep->tx_train || !packets || !buffer || count == 0) {
+    return false;
+  }
+
+  ep->iso_packets = packets;
+  ep->iso_count = count;
+  ep->iso_start_frame = sof_count;
+  ep->tx_slot = 0;
+  ep->tx_next_prepared = false;
+  ep->app_buf = buffer;
+  ep->total_len = 0;
+  ep->actual_len = 0;
+  ep->transfer_started = false;
+  ep->transfer_aborted = false;
+  ep->has_transfer = true;
+
+  pio_usb_ll_set_ep_bits(&PIO_USB_ROOT_PORT(root_idx)->ep_active,
+                         PIO_USB_ENDPOINT_MASK(ep));
+
+  return true;
+}
+
+bool pio_usb_host_endpoint_set_nak_policy(uint8_t root_idx,
+                                          uint8_t device_address,
+                                          uint8_t ep_address,
+                                          pio_usb_nak_policy_t policy,
+                                          uint8_t interval) {
+  // Control endpoint is found by either direction, and policy applies to its
+  // IN stages
+  endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
+  if (!ep || !(ep_address & EP_IN) ||
+      (policy != PIO_USB_NAK_POLICY_NONE && interval == 0)) {
+    return false;
+  }
+
+  ep->nak_wait = 0;
+  ep->nak_interval = interval;
+  ep->nak_policy = policy;
+  return true;
+}
+
 bool pio_usb_host_endpoint_abort_transfer(uint8_t root_idx, uint8_t device_address,
                                           uint8_t ep_address) {
   endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
@@ -523,6 +929,8 @@ bool pio_usb_host_endpoint_abort_transfer(uint8_t root_idx, uint8_t device_addre
   // check if transfer is still active (could be completed)
   bool const still_active = ep->has_transfer;
   if (still_active) {
+    pio_usb_ll_clear_ep_bits(&PIO_USB_ROOT_PORT(root_idx)->ep_active,
+                             PIO_USB_ENDPOINT_MASK(ep));
     ep->has_transfer = false;
   }
   ep->transfer_aborted = false;
@@ -534,27 +942,47 @@ bool pio_usb_host_endpoint_abort_transfer(uint8_t root_idx, uint8_t device_addre
 // Transaction helper
 //--------------------------------------------------------------------+
 
+// Defer next poll of ep after NAK according to its policy. Wait of 1 polls
+// in the next frame, same as no policy.
+static __always_inline void nak_backoff(endpoint_t *ep) {
+  if (ep->nak_policy == PIO_USB_NAK_POLICY_FIXED) {
+    ep->nak_wait = ep->nak_interval;
+  } else if (ep->nak_policy == PIO_USB_NAK_POLICY_EXPONENTIAL) {
+    uint16_t const wait = ep->nak_wait ? ep->nak_wait * 2 : 2;
+    ep->nak_wait = (wait < ep->nak_interval) ? wait : ep->nak_interval;
+  } else {
+    return;
+  }
+  ep->nak_resume_frame = sof_count + ep->nak_wait;
+}
+
 static int __no_inline_not_in_flash_func(usb_in_transaction)(pio_port_t *pp,
                                                              endpoint_t *ep) {
   int res = 0;
   uint8_t expect_pid = (ep->data_id == 1) ? USB_PID_DATA1 : USB_PID_DATA0;
 
   pio_usb_bus_prepare_receive(pp);
-  pio_usb_bus_send_token(pp, USB_PID_IN, ep->dev_addr, ep->ep_num);
+  pio_usb_bus_usb_transfer(pp, ep->token_encoded[EP_TOKEN_IN],
+                           ep->token_encoded_len[EP_TOKEN_IN]);
   pio_usb_bus_start_receive(pp);
 
-  int receive_len = pio_usb_bus_receive_packet_and_handshake(pp, USB_PID_ACK);
-  uint8_t const receive_pid = pp->usb_rx_buffer[1];
+  // Data is received into application buffer directly. It's committed only if
+  // data toggle matches.
+  uint8_t receive_pid;
+  int receive_len = pio_usb_bus_receive_data_and_handshake(
+      pp, USB_PID_ACK, ep->app_buf, pio_usb_ll_get_transaction_len(ep),
+      &receive_pid);
 
   if (receive_len >= 0) {
     if (receive_pid == expect_pid) {
-      memcpy(ep->app_buf, &pp->usb_rx_buffer[2], receive_len);
+      ep->nak_wait = 0;
       pio_usb_ll_transfer_continue(ep, receive_len);
     } else {
       // DATA0/1 mismatched, 0 for re-try next frame
     }
   } else if (receive_pid == USB_PID_NAK) {
-    // NAK try again next frame
+    // NAK try again next frame, or later by NAK policy
+    nak_backoff(ep);
   } else if (receive_pid == USB_PID_STALL) {
     pio_usb_ll_transfer_complete(ep, PIO_USB_INTS_ENDPOINT_STALLED_BITS);
   } else {
@@ -572,10 +1000,6 @@ static int __no_inline_not_in_flash_func(usb_in_transaction)(pio_port_t *pp,
     ep->failed_count = 0; // reset failed count if we got a sound response
   }
 
-  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, false);
-  pp->usb_rx_buffer[0] = 0;
-  pp->usb_rx_buffer[1] = 0;
-
   return res;
 }
 
@@ -586,15 +1010,12 @@ static int __no_inline_not_in_flash_func(usb_out_transaction)(pio_port_t *pp,
   uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
 
   pio_usb_bus_prepare_receive(pp);
-  pio_usb_bus_send_token(pp, USB_PID_OUT, ep->dev_addr, ep->ep_num);
-
-  pio_usb_bus_usb_transfer(pp, ep->buffer, ep->encoded_data_len);
+  pio_usb_bus_send_token_and_data(pp, ep, EP_TOKEN_OUT);
   pio_usb_bus_start_receive(pp);
 
-  pio_usb_bus_wait_handshake(pp);
-  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, false);
-
-  uint8_t const receive_token = pp->usb_rx_buffer[1];
+  // Handshake is captured by RX state machine while next packet is encoded
+  pio_usb_ll_prepare_next_tx(ep);
+  uint8_t const receive_token = pio_usb_bus_wait_handshake(pp);
 
   if (receive_token == USB_PID_ACK) {
     pio_usb_ll_transfer_continue(ep, xact_len);
@@ -613,9 +1034,56 @@ static int __no_inline_not_in_flash_func(usb_out_transaction)(pio_port_t *pp,
     ep->failed_count = 0;// reset failed count if we got a sound response
   }
 
-  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, false);
-  pp->usb_rx_buffer[0] = 0;
-  pp->usb_rx_buffer[1] = 0;
+  return res;
+}
+
+// Isochronous transaction of the next packet in ring. There is no handshake
+// and no retry, so the packet is DONE or ERROR after its frame.
+static int __no_inline_not_in_flash_func(usb_iso_transaction)(pio_port_t *pp,
+                                                              endpoint_t *ep) {
+  int res = 0;
+  uint16_t const idx = iso_packet_index(ep, sof_count);
+  pio_usb_iso_packet_t *packet = &ep->iso_packets[idx];
+  uint8_t *buf = ep->app_buf + idx * ep->size;
+
+  if (packet->status != PIO_USB_ISO_READY) {
+    ep->tx_next_prepared = false; // OUT packet encoded for past frame
+    return 0; // skipped frame
+  }
+
+  uint16_t const len = (packet->length < ep->size) ? packet->length : ep->size;
+
+  if (ep->ep_num & EP_IN) {
+    pio_usb_bus_prepare_receive(pp);
+    pio_usb_bus_usb_transfer(pp, ep->token_encoded[EP_TOKEN_IN],
+                             ep->token_encoded_len[EP_TOKEN_IN]);
+    pio_usb_bus_start_receive(pp);
+
+    uint8_t receive_pid;
+    int const receive_len =
+        pio_usb_bus_receive_data_and_handshake(pp, 0, buf, len, &receive_pid);
+
+    if (receive_len >= 0 &&
+        (receive_pid == USB_PID_DATA0 || receive_pid == USB_PID_DATA1)) {
+      packet->actual_length = (receive_len < len) ? receive_len : len;
+      packet->status = PIO_USB_ISO_DONE;
+    } else {
+      res = -1;
+      packet->actual_length = 0;
+      packet->status = PIO_USB_ISO_ERROR;
+    }
+  } else if (ep->tx_next_prepared && ep->iso_prepared_frame == sof_count) {
+    pio_usb_bus_send_token_and_data(pp, ep, EP_TOKEN_OUT);
+    packet->actual_length = len;
+    packet->status = PIO_USB_ISO_DONE;
+    ep->tx_next_prepared = false;
+  } else {
+    // Not encoded by pio_usb_host_task() in time. Drop a stale one.
+    res = -1;
+    ep->tx_next_prepared = false;
+    packet->actual_length = 0;
+    packet->status = PIO_USB_ISO_ERROR;
+  }
 
   return res;
 }
@@ -624,18 +1092,14 @@ static int __no_inline_not_in_flash_func(usb_setup_transaction)(
     pio_port_t *pp,  endpoint_t *ep) {
   int res = 0;
 
-  // Setup token
+  // Setup token and data
   pio_usb_bus_prepare_receive(pp);
-  pio_usb_bus_send_token(pp, USB_PID_SETUP, ep->dev_addr, 0);
-
-  // Data
   ep->data_id = 0; // set to DATA0
-  pio_usb_bus_usb_transfer(pp, ep->buffer, ep->encoded_data_len);
+  pio_usb_bus_send_token_and_data(pp, ep, EP_TOKEN_SETUP);
 
   // Handshake
   pio_usb_bus_start_receive(pp);
   const uint8_t handshake = pio_usb_bus_wait_handshake(pp);
-  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, false);
 
   if (handshake == USB_PID_ACK) {
     ep->actual_len = 8;
@@ -652,8 +1116,6 @@ static int __no_inline_not_in_flash_func(usb_setup_transaction)(
     ep->failed_count = 0;// reset failed count if we got a sound response
   }
 
-  pp->usb_rx_buffer[1] = 0; // reset buffer
-
   return res;
 }
 
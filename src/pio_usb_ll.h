@@ -7,6 +7,7 @@
 
 #include "hardware/pio.h"
 #include "hardware/regs/sysinfo.h"
+#include "hardware/sync.h"
 #include "pio_usb_configuration.h"
 #include "usb_definitions.h"
 #include <stdint.h>
@@ -65,10 +66,15 @@ typedef struct {
   uint offset_rx;
   uint sm_eop;
   uint offset_eop;
+  uint rx_ch;
+  uint sm_rx_timeout;
+  uint offset_rx_timeout;
   uint tx_reset_instr;
   uint tx_start_instr;
+  uint tx_arm_instr;
   uint rx_reset_instr;
   uint rx_reset_instr2;
+  bool rx_rearm_in_pio;
   uint device_rx_irq_num;
 
   int8_t debug_pin_rx;
@@ -86,7 +92,10 @@ typedef struct {
   bool need_pre;
   bool low_speed;
 
-  uint8_t usb_rx_buffer[128];
+  root_port_t *root; // being serviced
+
+  // Packet received by device, and whole packet landed by PIO_USB_RX_DMA
+  uint8_t usb_rx_buffer[PIO_USB_RX_BUFFER_SIZE];
 } pio_port_t;
 
 //--------------------------------------------------------------------+
@@ -106,10 +115,30 @@ extern root_port_t pio_usb_root_port[PIO_USB_ROOT_PORT_CNT];
 
 extern endpoint_t pio_usb_ep_pool[PIO_USB_EP_POOL_CNT];
 #define PIO_USB_ENDPOINT(_idx) (pio_usb_ep_pool + (_idx))
+#define PIO_USB_ENDPOINT_MASK(_ep) (1u << ((_ep) - pio_usb_ep_pool))
 
 extern pio_port_t pio_port[1];
 #define PIO_USB_PIO_PORT(_idx) (pio_port + (_idx))
 
+// Endpoint bitmaps of root port are modified by application on one core and
+// by frame interrupt on the other. Masking interrupts covers only the local
+// core, so read-modify-write is done holding this hardware spinlock.
+extern spin_lock_t *pio_usb_ep_lock;
+
+static __always_inline void pio_usb_ll_set_ep_bits(volatile uint32_t *bitmap,
+                                                   uint32_t mask) {
+  uint32_t const status = spin_lock_blocking(pio_usb_ep_lock);
+  *bitmap |= mask;
+  spin_unlock(pio_usb_ep_lock, status);
+}
+
+static __always_inline void pio_usb_ll_clear_ep_bits(volatile uint32_t *bitmap,
+                                                     uint32_t mask) {
+  uint32_t const status = spin_lock_blocking(pio_usb_ep_lock);
+  *bitmap &= ~mask;
+  spin_unlock(pio_usb_ep_lock, status);
+}
+
 //--------------------------------------------------------------------+
 // Bus functions
 //--------------------------------------------------------------------+
@@ -117,7 +146,9 @@ extern pio_port_t pio_port[1];
 #define IRQ_TX_EOP_MASK (1 << IRQ_TX_EOP)
 #define IRQ_TX_ALL_MASK (IRQ_TX_EOP_MASK)
 #define IRQ_RX_COMP_MASK (1 << IRQ_RX_EOP)
+#define IRQ_RX_BS_ERR_MASK (1 << IRQ_RX_BS_ERR)
 #define IRQ_RX_START_MASK (1 << IRQ_RX_START)
+#define IRQ_RX_TIMEOUT_MASK (1 << IRQ_RX_TIMEOUT)
 #define IRQ_RX_ALL_MASK                                             \
   ((1 << IRQ_RX_EOP) | (1 << IRQ_RX_BS_ERR) | (1 << IRQ_RX_START) | \
    (1 << DECODER_TRIGGER))
@@ -131,13 +162,18 @@ void pio_usb_bus_init(pio_port_t *pp, const pio_usb_configuration_t *c,
                       root_port_t *root);
 
 void pio_usb_bus_prepare_receive(const pio_port_t *pp);
-int pio_usb_bus_receive_packet_and_handshake(pio_port_t *pp, uint8_t handshake);
+int pio_usb_bus_receive_data_and_handshake(pio_port_t *pp, uint8_t handshake,
+                                           uint8_t *buffer, uint16_t buflen,
+                                           uint8_t *pid);
 void pio_usb_bus_usb_transfer(pio_port_t *pp, uint8_t *data,
                               uint16_t len);
 
 uint8_t pio_usb_bus_wait_handshake(pio_port_t *pp);
+
 void pio_usb_bus_send_token(pio_port_t *pp, uint8_t token, uint8_t addr,
                             uint8_t ep_num);
+void pio_usb_bus_send_token_and_data(pio_port_t *pp, endpoint_t *ep,
+                                     ep_token_t token);
 
 static __always_inline port_pin_status_t
 pio_usb_bus_get_line_state(root_port_t *root) {
@@ -165,6 +201,18 @@ pio_usb_bus_get_line_state(root_port_t *root) {
   return (dm << 1) | dp;
 }
 
+// Reset decoder for the next packet. With re-arm prologue in PIO, a single
+// exec clears x and ISR and jumps to the decoder.
+static __always_inline void pio_usb_bus_rearm_receive(const pio_port_t *pp) {
+  if (pp->rx_rearm_in_pio) {
+    pio_sm_exec(pp->pio_usb_rx, pp->sm_rx, pp->rx_reset_instr);
+  } else {
+    pio_sm_restart(pp->pio_usb_rx, pp->sm_rx);
+    pio_sm_exec(pp->pio_usb_rx, pp->sm_rx, pp->rx_reset_instr);
+    pio_sm_exec(pp->pio_usb_rx, pp->sm_rx, pp->rx_reset_instr2);
+  }
+}
+
 static __always_inline void pio_usb_bus_start_receive(const pio_port_t *pp) {
   pp->pio_usb_rx->irq = IRQ_RX_ALL_MASK;
   while ((pp->pio_usb_rx->irq & IRQ_RX_ALL_MASK) != 0) {
@@ -172,16 +220,54 @@ static __always_inline void pio_usb_bus_start_receive(const pio_port_t *pp) {
   }
 }
 
+#if PIO_USB_RX_WORD_PUSH
+// Push bytes left in ISR after EOP. Decoder shifts one extra bit for SE0 of
+// EOP, so pad it to a byte, then pad ISR by byte until it is pushed. Received
+// bytes are placed from LSB of *word. Returns number of received bytes.
+static __always_inline uint8_t pio_usb_bus_flush_rx_word(const pio_port_t *pp,
+                                                         uint32_t *word) {
+  PIO pio = pp->pio_usb_rx;
+  uint sm = pp->sm_rx;
+
+  pio_sm_exec(pio, sm, pio_encode_in(pio_null, 7));
+  for (uint8_t len = 3; len > 0; len--) {
+    if (!pio_sm_is_rx_fifo_empty(pio, sm)) {
+      *word = pio_sm_get(pio, sm);
+      return len;
+    }
+    pio_sm_exec(pio, sm, pio_encode_in(pio_null, 8));
+  }
+  *word = pio_sm_get_blocking(pio, sm);
+  return 0;
+}
+#endif
+
+// Receive packet into usb_rx_buffer
+static __always_inline int
+pio_usb_bus_receive_packet_and_handshake(pio_port_t *pp, uint8_t handshake) {
+  uint8_t pid;
+  return pio_usb_bus_receive_data_and_handshake(
+      pp, handshake, pp->usb_rx_buffer + 2, PIO_USB_RX_BUFFER_SIZE - 2, &pid);
+}
+
 //--------------------------------------------------------------------+
 // Low Level functions
 //--------------------------------------------------------------------+
 
 void pio_usb_ll_configure_endpoint(endpoint_t *ep,
                                    uint8_t const *desc_endpoint);
+bool pio_usb_ll_alloc_buffer(endpoint_t *ep, bool tx);
+void pio_usb_ll_free_buffer(endpoint_t *ep);
+void pio_usb_ll_reset_buffers(void);
 bool pio_usb_ll_transfer_start(endpoint_t *ep, uint8_t *buffer,
                                uint16_t buflen);
 bool pio_usb_ll_transfer_continue(endpoint_t *ep, uint16_t xferred_bytes);
 void pio_usb_ll_transfer_complete(endpoint_t *ep, uint32_t flag);
+void pio_usb_ll_prepare_next_tx(endpoint_t *ep);
+void pio_usb_ll_set_tx_train(endpoint_t *ep, uint8_t *train, uint16_t size);
+void pio_usb_ll_prepare_iso_tx(endpoint_t *ep, uint8_t const *data,
+                               uint16_t len);
+void pio_usb_ll_encode_token(endpoint_t *ep);
 
 static inline __force_inline uint16_t
 pio_usb_ll_get_transaction_len(endpoint_t *ep) {
@@ -189,6 +275,32 @@ pio_usb_ll_get_transaction_len(endpoint_t *ep) {
   return (remaining < ep->size) ? remaining : ep->size;
 }
 
+// Encoded DATA packet of current transaction
+static inline __force_inline uint8_t *pio_usb_ll_get_tx_data(endpoint_t *ep) {
+  if (ep->tx_train) {
+    return ep->tx_train + ep->tx_train_offset + 1 + PIO_USB_TX_TOKEN_ROOM;
+  }
+  return ep->buffer[ep->tx_slot] + PIO_USB_TX_TOKEN_ROOM;
+}
+
+static inline __force_inline uint16_t
+pio_usb_ll_get_tx_data_len(endpoint_t *ep) {
+  if (ep->tx_train) {
+    return ep->tx_train[ep->tx_train_offset];
+  }
+  return ep->encoded_data_len[ep->tx_slot];
+}
+
+#if PIO_USB_TX_ENCODE_IN_PIO
+#define PIO_USB_TX_CYCLES_PER_BIT 8
+#define PIO_USB_TX_HANDSHAKE_LEN 3 // length, SYNC, PID
+#define PIO_USB_TX_EOP_INSTR_OFFSET usb_tx_nrzi_dpdm_offset_se0
+#else
+#define PIO_USB_TX_CYCLES_PER_BIT 4
+#define PIO_USB_TX_HANDSHAKE_LEN 5 // SYNC, PID and EOP
+#define PIO_USB_TX_EOP_INSTR_OFFSET 0
+#endif
+
 enum {
   PIO_USB_TX_ENCODED_DATA_SE0 = 0,
   PIO_USB_TX_ENCODED_DATA_K = 1,
@@ -221,6 +333,19 @@ bool pio_usb_host_endpoint_transfer(uint8_t root_idx, uint8_t device_address,
                                     uint16_t buflen);
 bool pio_usb_host_endpoint_abort_transfer(uint8_t root_idx, uint8_t device_address,
                                           uint8_t ep_address);
+bool pio_usb_host_endpoint_set_tx_train(uint8_t root_idx,
+                                        uint8_t device_address,
+                                        uint8_t ep_address, uint8_t *train,
+                                        uint16_t size);
+bool pio_usb_host_endpoint_iso_start(uint8_t root_idx, uint8_t device_address,
+                                     uint8_t ep_address,
+                                     pio_usb_iso_packet_t *packets,
+                                     uint8_t *buffer, uint16_t count);
+bool pio_usb_host_endpoint_set_nak_policy(uint8_t root_idx,
+                                          uint8_t device_address,
+                                          uint8_t ep_address,
+                                          pio_usb_nak_policy_t policy,
+                                          uint8_t interval);
 
 //--------------------------------------------------------------------
 // Device Controller functions
@@ -233,6 +358,10 @@ void pio_usb_device_set_address(uint8_t dev_addr);
 bool pio_usb_device_endpoint_open(uint8_t const *desc_endpoint);
 bool pio_usb_device_transfer(uint8_t ep_address, uint8_t *buffer,
                              uint16_t buflen);
+void pio_usb_device_endpoint_stall(uint8_t ep_address);
+void pio_usb_device_endpoint_clear_stall(uint8_t ep_address);
+bool pio_usb_device_endpoint_set_tx_train(uint8_t ep_address, uint8_t *train,
+                                          uint16_t size);
 
 static inline __force_inline endpoint_t *
 pio_usb_device_get_endpoint_by_address(uint8_t ep_address) {
@@ -2,11 +2,15 @@
 
 #include <stdint.h>
 #include "pico/stdlib.h"
+#include "hardware/interp.h"
 
 // Calc CRC5-USB of 11bit data
 uint8_t calc_usb_crc5(uint16_t data);
 // Calc CRC16-USB of array
 uint16_t calc_usb_crc16(const uint8_t *data, uint16_t len);
+uint16_t calc_usb_crc16_nibble(const uint8_t *data, uint16_t len);
+uint16_t calc_usb_crc16_slice4(const uint8_t *data, uint16_t len);
+uint16_t calc_usb_crc16_interp(const uint8_t *data, uint16_t len);
 
 extern const uint16_t crc16_tbl[256];
 static inline uint16_t __time_critical_func(update_usb_crc16)(uint16_t crc, uint8_t data) {
@@ -14,6 +18,22 @@ static inline uint16_t __time_critical_func(update_usb_crc16)(uint16_t crc, uint
   return crc;
 }
 
+extern const uint16_t crc16_nibble_tbl[16];
+static inline uint16_t __time_critical_func(update_usb_crc16_nibble)(uint16_t crc, uint8_t data) {
+  crc = (crc >> 4) ^ crc16_nibble_tbl[(crc ^ data) & 0x0f];
+  crc = (crc >> 4) ^ crc16_nibble_tbl[(crc ^ (data >> 4)) & 0x0f];
+  return crc;
+}
+
+extern const uint16_t crc16_slice_tbl[3][256];
+
+// Configure interp1 of the calling core for update_usb_crc16_interp()
+void usb_crc16_interp_init(void);
+static inline uint16_t __time_critical_func(update_usb_crc16_interp)(uint16_t crc, uint8_t data) {
+  interp1->accum[0] = (uint32_t)(crc ^ data) << 1;
+  return interp1->peek[1] ^ *(const uint16_t *)(uintptr_t)interp1->peek[0];
+}
+
 #ifndef PICO_DEFAULT_TIMER_INSTANCE // not defined in sdk v1
 #define PICO_DEFAULT_TIMER_INSTANCE() timer_hw
 #endif
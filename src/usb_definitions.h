@@ -5,6 +5,53 @@
 
 #include "pio_usb_configuration.h"
 
+// Size of TX buffer for a packet of len bytes including SYNC and PID
+#if PIO_USB_TX_ENCODE_IN_PIO
+#define PIO_USB_TX_ENCODED_LEN(len) ((len) + 1) // packet length + raw packet
+// Packet length is a byte, and SYNC, PID and CRC16 are counted in it
+#define PIO_USB_TX_MAX_PAYLOAD 251
+#else
+#define PIO_USB_TX_ENCODED_LEN(len) ((len) * 2 * 7 / 6 + 2)
+#define PIO_USB_TX_MAX_PAYLOAD 1023
+#endif
+
+// Room for a token packet sent by the same DMA transfer as DATA packet
+#define PIO_USB_TX_TOKEN_ROOM PIO_USB_TX_ENCODED_LEN(4)
+
+// Encoded DATA packet buffers of a TX endpoint
+#if PIO_USB_TX_DOUBLE_BUFFER
+#define PIO_USB_TX_SLOT_CNT 2
+#else
+#define PIO_USB_TX_SLOT_CNT 1
+#endif
+
+// Size of endpoint buffer allocated from arena. TX endpoints hold
+// PIO_USB_TX_SLOT_CNT encoded DATA packets, others hold a raw packet used by
+// pio_usb_get_in_data().
+#define PIO_USB_EP_BUFFER_SIZE(ep_size, is_tx)                         \
+  ((is_tx) ? PIO_USB_TX_SLOT_CNT * (PIO_USB_TX_TOKEN_ROOM +            \
+                                    PIO_USB_TX_ENCODED_LEN((ep_size) + 4)) \
+           : (ep_size))
+
+// Size of packet train buffer to pre-encode a transfer of len bytes to an
+// endpoint of ep_size. Each packet is stored as [encoded length][room for
+// token][encoded DATA packet].
+#define PIO_USB_TX_TRAIN_PACKET_SIZE(ep_size) \
+  (1 + PIO_USB_TX_TOKEN_ROOM + PIO_USB_TX_ENCODED_LEN((ep_size) + 4))
+#define PIO_USB_TX_TRAIN_SIZE(len, ep_size)                  \
+  ((((len) + (ep_size) - 1) / (ep_size) + ((len) == 0)) * \
+   PIO_USB_TX_TRAIN_PACKET_SIZE(ep_size))
+
+// Size of RX buffer of PIO port, holding SYNC, PID and data
+#define PIO_USB_RX_BUFFER_SIZE 128
+
+// DMA lands whole packet in RX buffer, otherwise data goes to endpoint buffer
+#if PIO_USB_RX_DMA
+#define PIO_USB_RX_MAX_PAYLOAD (PIO_USB_RX_BUFFER_SIZE - 4)
+#else
+#define PIO_USB_RX_MAX_PAYLOAD 1023
+#endif
+
 typedef enum {
   CONTROL_NONE,
   CONTROL_IN,
@@ -18,6 +65,37 @@ typedef enum {
   EP_OUT = 0x00,
 } ep_type_t;
 
+typedef enum {
+  EP_TOKEN_IN,
+  EP_TOKEN_OUT,
+  EP_TOKEN_SETUP,
+  EP_TOKEN_CNT,
+} ep_token_t;
+
+// Host isochronous packet descriptor. Application sets length and marks it
+// READY. It's DONE with actual_length, or ERROR if no valid DATA packet was
+// received, after the frame it's scheduled in.
+typedef enum {
+  PIO_USB_ISO_IDLE,  // frame is skipped
+  PIO_USB_ISO_READY, // armed by application
+  PIO_USB_ISO_DONE,
+  PIO_USB_ISO_ERROR,
+} pio_usb_iso_status_t;
+
+typedef struct {
+  volatile uint8_t status; // pio_usb_iso_status_t
+  uint16_t length;         // OUT: bytes to send, IN: room in buffer
+  volatile uint16_t actual_length;
+} pio_usb_iso_packet_t;
+
+// Host: how an IN endpoint is polled after NAK, reset when data is received
+typedef enum {
+  PIO_USB_NAK_POLICY_NONE,        // poll every frame
+  PIO_USB_NAK_POLICY_FIXED,       // poll every nak_interval frames after NAK
+  PIO_USB_NAK_POLICY_EXPONENTIAL, // poll every 2, 4, 8... frames after NAK, up
+                                  // to every nak_interval frames
+} pio_usb_nak_policy_t;
+
 typedef enum {
   STAGE_SETUP,
   STAGE_DATA,
@@ -65,7 +143,22 @@ typedef struct {
 
   volatile uint8_t attr;
   volatile uint8_t interval;
-  volatile uint8_t interval_counter;
+  // Host interrupt and isochronous endpoint is polled in frames where
+  // (frame & (period - 1)) == phase. period is a power of two.
+  uint8_t period;
+  uint8_t phase;
+  uint16_t periodic_time_us; // estimated bus time reserved in each poll
+
+  // Host isochronous ring. Packet i uses app_buf + i * size.
+  pio_usb_iso_packet_t *iso_packets;
+  uint16_t iso_count;
+  uint32_t iso_start_frame;
+  uint32_t iso_prepared_frame; // frame of OUT packet encoded by host task
+
+  uint8_t nak_policy; // pio_usb_nak_policy_t
+  uint8_t nak_interval;
+  uint8_t nak_wait; // frames to wait after the last NAK
+  uint16_t nak_resume_frame;
   volatile uint8_t data_id; // data0 or data1
 
   volatile bool stalled;
@@ -73,8 +166,20 @@ typedef struct {
   volatile bool transfer_started;
   volatile bool transfer_aborted;
 
-  uint8_t buffer[(64 + 4) * 2 * 7 / 6 + 2];
-  uint8_t encoded_data_len;
+  // Encoded DATA packets allocated from arena. With PIO_USB_TX_DOUBLE_BUFFER
+  // next packet is encoded into buffer[1] while current one is on the bus.
+  uint8_t *buffer[2];
+  uint16_t buffer_size;
+  uint16_t encoded_data_len[2];
+  uint8_t tx_slot; // index of buffer holding current packet
+  volatile bool tx_next_prepared;
+  // Optional buffer to pre-encode whole transfer into at transfer start
+  uint8_t *tx_train;
+  uint16_t tx_train_size;
+  uint16_t tx_train_offset; // current packet in tx_train
+  // Host only, pre-encoded tokens in storage of the host controller
+  uint8_t (*token_encoded)[PIO_USB_TX_TOKEN_ROOM];
+  uint8_t token_encoded_len[EP_TOKEN_CNT];
   uint8_t failed_count;
 
   uint8_t *app_buf;
@@ -111,6 +216,12 @@ typedef struct struct_root_port_t {
   volatile uint32_t ep_stalled;
   volatile uint32_t ep_continue;
 
+  // host only, bitmaps of endpoint pool scheduled on this port
+  volatile uint32_t ep_active;   // has transfer
+  volatile uint32_t ep_periodic; // opened interrupt or isochronous endpoint
+
+  uint32_t rx_bs_err_count; // packets dropped by bit stuffing error
+
   // device only
   uint8_t dev_addr;
   uint8_t *setup_packet;
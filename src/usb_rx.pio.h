@@ -12,6 +12,7 @@
 #define IRQ_RX_EOP 2
 #define IRQ_RX_START 3
 #define DECODER_TRIGGER 4
+#define IRQ_RX_TIMEOUT 5
 
 // ----------------- //
 // usb_edge_detector //
@@ -231,3 +232,150 @@ static inline void eop_detect_fs_program_init(PIO pio, uint sm, uint offset,
 
 #endif
 
+// ------------------- //
+// usb_nrzi_decoder_bs //
+// ------------------- //
+
+#define usb_nrzi_decoder_bs_wrap_target 0
+#define usb_nrzi_decoder_bs_wrap 6
+
+static const uint16_t usb_nrzi_decoder_bs_program_instructions[] = {
+            //     .wrap_target
+    0xe046, //  0: set    y, 6                       
+    0x20c4, //  1: wait   1 irq, 4                   
+    0x00c7, //  2: jmp    pin, 7                     
+    0x0028, //  3: jmp    !x, 8                      
+    0x0066, //  4: jmp    !y, 6                      
+    0x4061, //  5: in     null, 1                    
+    0xa029, //  6: mov    x, !x                      
+            //     .wrap
+    0x0024, //  7: jmp    !x, 4                      
+    0x40e1, //  8: in     osr, 1                     
+    0x0081, //  9: jmp    y--, 1                     
+    0xc001, // 10: irq    nowait 1                   
+    0x0000, // 11: jmp    0                          
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program usb_nrzi_decoder_bs_program = {
+    .instructions = usb_nrzi_decoder_bs_program_instructions,
+    .length = 12,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_nrzi_decoder_bs_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_nrzi_decoder_bs_wrap_target, offset + usb_nrzi_decoder_bs_wrap);
+    return c;
+}
+#endif
+
+// ------------------------- //
+// usb_nrzi_decoder_bs_debug //
+// ------------------------- //
+
+#define usb_nrzi_decoder_bs_debug_wrap_target 0
+#define usb_nrzi_decoder_bs_debug_wrap 6
+
+static const uint16_t usb_nrzi_decoder_bs_debug_program_instructions[] = {
+            //     .wrap_target
+    0xe046, //  0: set    y, 6                       
+    0x20c4, //  1: wait   1 irq, 4                   
+    0x00c7, //  2: jmp    pin, 7                     
+    0x1028, //  3: jmp    !x, 8           side 0     
+    0x0066, //  4: jmp    !y, 6                      
+    0x4061, //  5: in     null, 1                    
+    0xa029, //  6: mov    x, !x                      
+            //     .wrap
+    0x1824, //  7: jmp    !x, 4           side 1     
+    0x40e1, //  8: in     osr, 1                     
+    0x0081, //  9: jmp    y--, 1                     
+    0xc001, // 10: irq    nowait 1                   
+    0x0000, // 11: jmp    0                          
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program usb_nrzi_decoder_bs_debug_program = {
+    .instructions = usb_nrzi_decoder_bs_debug_program_instructions,
+    .length = 12,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_nrzi_decoder_bs_debug_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_nrzi_decoder_bs_debug_wrap_target, offset + usb_nrzi_decoder_bs_debug_wrap);
+    sm_config_set_sideset(&c, 2, true, false);
+    return c;
+}
+#endif
+
+// -------------- //
+// usb_rx_timeout //
+// -------------- //
+
+#define usb_rx_timeout_wrap_target 0
+#define usb_rx_timeout_wrap 1
+
+static const uint16_t usb_rx_timeout_program_instructions[] = {
+            //     .wrap_target
+    0x0340, //  0: jmp    x--, 0                 [3] 
+    0xc025, //  1: irq    wait 5                     
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program usb_rx_timeout_program = {
+    .instructions = usb_rx_timeout_program_instructions,
+    .length = 2,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_rx_timeout_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_rx_timeout_wrap_target, offset + usb_rx_timeout_wrap);
+    return c;
+}
+
+static inline void usb_rx_timeout_program_init(PIO pio, uint sm, uint offset,
+                                               uint32_t start_ticks,
+                                               uint32_t entry_ticks) {
+  pio_sm_config c = usb_rx_timeout_program_get_default_config(offset);
+  pio_sm_init(pio, sm, offset, &c);
+  pio_sm_put(pio, sm, start_ticks);
+  pio_sm_exec(pio, sm, pio_encode_pull(false, false));
+  pio_sm_exec(pio, sm, pio_encode_mov(pio_isr, pio_osr));
+  pio_sm_put(pio, sm, entry_ticks);
+  pio_sm_exec(pio, sm, pio_encode_pull(false, false));
+  pio_sm_set_enabled(pio, sm, true);
+}
+
+#endif
+
+// ---------------------- //
+// usb_nrzi_decoder_rearm //
+// ---------------------- //
+
+#define usb_nrzi_decoder_rearm_wrap_target 0
+#define usb_nrzi_decoder_rearm_wrap 1
+
+static const uint16_t usb_nrzi_decoder_rearm_program_instructions[] = {
+            //     .wrap_target
+    0xe020, //  0: set    x, 0                       
+    0xa0c3, //  1: mov    isr, null                  
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program usb_nrzi_decoder_rearm_program = {
+    .instructions = usb_nrzi_decoder_rearm_program_instructions,
+    .length = 2,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_nrzi_decoder_rearm_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_nrzi_decoder_rearm_wrap_target, offset + usb_nrzi_decoder_rearm_wrap);
+    return c;
+}
+#endif
+
@@ -17,6 +17,7 @@
 #define usb_tx_dpdm_wrap_target 1
 #define usb_tx_dpdm_wrap 4
 #define usb_tx_dpdm_FJ_LK 1
+#define usb_tx_dpdm_offset_start 4u
 
 static const uint16_t __not_in_flash("tx_program") usb_tx_dpdm_program_instructions[] = {
     0xc700, //  0: irq    nowait 0        side 0 [7] 
@@ -138,6 +139,236 @@ static inline pio_sm_config usb_tx_pre_dmdp_program_get_default_config(uint offs
     sm_config_set_sideset(&c, 2, false, false);
     return c;
 }
+#endif
+
+// ---------------- //
+// usb_tx_nrzi_dpdm //
+// ---------------- //
+
+#define usb_tx_nrzi_dpdm_wrap_target 0
+#define usb_tx_nrzi_dpdm_wrap 26
+#define usb_tx_nrzi_dpdm_FJ_LK 1
+#define usb_tx_nrzi_dpdm_offset_se0 9u
+#define usb_tx_nrzi_dpdm_offset_release 13u
+#define usb_tx_nrzi_dpdm_offset_idle 14u
+#define usb_tx_nrzi_dpdm_offset_start 19u
+
+static const uint16_t __not_in_flash("tx_program") usb_tx_nrzi_dpdm_program_instructions[] = {
+            //     .wrap_target
+    0x0003, //  0: jmp    3                          
+    0x0346, //  1: jmp    x--, 6                 [3] 
+    0x0403, //  2: jmp    3                      [4] 
+    0xa0ce, //  3: mov    isr, !isr                  
+    0xa006, //  4: mov    pins, isr                  
+    0xe025, //  5: set    x, 5                       
+    0x00ef, //  6: jmp    !osre, 15                  
+    0x0091, //  7: jmp    y--, 17                    
+    0xc300, //  8: irq    nowait 0               [3] 
+    0xef00, //  9: set    pins, 0                [15] 
+    0xe501, // 10: set    pins, 1                [5] 
+    0xa025, // 11: mov    x, status                  
+    0x0035, // 12: jmp    !x, 21                     
+    0xe080, // 13: set    pindirs, 0                 
+    0x000e, // 14: jmp    14                         
+    0xa142, // 15: nop                           [1] 
+    0x60a1, // 16: out    pc, 1                      
+    0x80a0, // 17: pull   block                      
+    0x60a1, // 18: out    pc, 1                      
+    0xe001, // 19: set    pins, 1                    
+    0xe083, // 20: set    pindirs, 3                 
+    0xe021, // 21: set    x, 1                       
+    0xa0c1, // 22: mov    isr, x                     
+    0x80a0, // 23: pull   block                      
+    0x6048, // 24: out    y, 8                       
+    0x0091, // 25: jmp    y--, 17                    
+    0x0008, // 26: jmp    8                          
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program __not_in_flash("tx_program") usb_tx_nrzi_dpdm_program = {
+    .instructions = usb_tx_nrzi_dpdm_program_instructions,
+    .length = 27,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_tx_nrzi_dpdm_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_tx_nrzi_dpdm_wrap_target, offset + usb_tx_nrzi_dpdm_wrap);
+    return c;
+}
+#endif
+
+// -------------------- //
+// usb_tx_nrzi_pre_dpdm //
+// -------------------- //
+
+#define usb_tx_nrzi_pre_dpdm_wrap_target 0
+#define usb_tx_nrzi_pre_dpdm_wrap 26
+#define usb_tx_nrzi_pre_dpdm_offset_se0 9u
+#define usb_tx_nrzi_pre_dpdm_offset_release 13u
+#define usb_tx_nrzi_pre_dpdm_offset_idle 14u
+#define usb_tx_nrzi_pre_dpdm_offset_start 19u
+
+static const uint16_t __not_in_flash("tx_program") usb_tx_nrzi_pre_dpdm_program_instructions[] = {
+            //     .wrap_target
+    0x0003, //  0: jmp    3                          
+    0x0346, //  1: jmp    x--, 6                 [3] 
+    0x0403, //  2: jmp    3                      [4] 
+    0xa0ce, //  3: mov    isr, !isr                  
+    0xa006, //  4: mov    pins, isr                  
+    0xe025, //  5: set    x, 5                       
+    0x00ef, //  6: jmp    !osre, 15                  
+    0x0091, //  7: jmp    y--, 17                    
+    0xc300, //  8: irq    nowait 0               [3] 
+    0xef01, //  9: set    pins, 1                [15] 
+    0xe501, // 10: set    pins, 1                [5] 
+    0xa025, // 11: mov    x, status                  
+    0x0035, // 12: jmp    !x, 21                     
+    0xe080, // 13: set    pindirs, 0                 
+    0x000e, // 14: jmp    14                         
+    0xa142, // 15: nop                           [1] 
+    0x60a1, // 16: out    pc, 1                      
+    0x80a0, // 17: pull   block                      
+    0x60a1, // 18: out    pc, 1                      
+    0xe001, // 19: set    pins, 1                    
+    0xe083, // 20: set    pindirs, 3                 
+    0xe021, // 21: set    x, 1                       
+    0xa0c1, // 22: mov    isr, x                     
+    0x80a0, // 23: pull   block                      
+    0x6048, // 24: out    y, 8                       
+    0x0091, // 25: jmp    y--, 17                    
+    0x0008, // 26: jmp    8                          
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program __not_in_flash("tx_program") usb_tx_nrzi_pre_dpdm_program = {
+    .instructions = usb_tx_nrzi_pre_dpdm_program_instructions,
+    .length = 27,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_tx_nrzi_pre_dpdm_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_tx_nrzi_pre_dpdm_wrap_target, offset + usb_tx_nrzi_pre_dpdm_wrap);
+    return c;
+}
+#endif
+
+// ---------------- //
+// usb_tx_nrzi_dmdp //
+// ---------------- //
+
+#define usb_tx_nrzi_dmdp_wrap_target 0
+#define usb_tx_nrzi_dmdp_wrap 26
+#define usb_tx_nrzi_dmdp_FJ_LK 2
+#define usb_tx_nrzi_dmdp_offset_se0 9u
+#define usb_tx_nrzi_dmdp_offset_release 13u
+#define usb_tx_nrzi_dmdp_offset_idle 14u
+#define usb_tx_nrzi_dmdp_offset_start 19u
+
+static const uint16_t __not_in_flash("tx_program") usb_tx_nrzi_dmdp_program_instructions[] = {
+            //     .wrap_target
+    0x0003, //  0: jmp    3                          
+    0x0346, //  1: jmp    x--, 6                 [3] 
+    0x0403, //  2: jmp    3                      [4] 
+    0xa0ce, //  3: mov    isr, !isr                  
+    0xa006, //  4: mov    pins, isr                  
+    0xe025, //  5: set    x, 5                       
+    0x00ef, //  6: jmp    !osre, 15                  
+    0x0091, //  7: jmp    y--, 17                    
+    0xc300, //  8: irq    nowait 0               [3] 
+    0xef00, //  9: set    pins, 0                [15] 
+    0xe502, // 10: set    pins, 2                [5] 
+    0xa025, // 11: mov    x, status                  
+    0x0035, // 12: jmp    !x, 21                     
+    0xe080, // 13: set    pindirs, 0                 
+    0x000e, // 14: jmp    14                         
+    0xa142, // 15: nop                           [1] 
+    0x60a1, // 16: out    pc, 1                      
+    0x80a0, // 17: pull   block                      
+    0x60a1, // 18: out    pc, 1                      
+    0xe002, // 19: set    pins, 2                    
+    0xe083, // 20: set    pindirs, 3                 
+    0xe022, // 21: set    x, 2                       
+    0xa0c1, // 22: mov    isr, x                     
+    0x80a0, // 23: pull   block                      
+    0x6048, // 24: out    y, 8                       
+    0x0091, // 25: jmp    y--, 17                    
+    0x0008, // 26: jmp    8                          
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program __not_in_flash("tx_program") usb_tx_nrzi_dmdp_program = {
+    .instructions = usb_tx_nrzi_dmdp_program_instructions,
+    .length = 27,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_tx_nrzi_dmdp_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_tx_nrzi_dmdp_wrap_target, offset + usb_tx_nrzi_dmdp_wrap);
+    return c;
+}
+#endif
+
+// -------------------- //
+// usb_tx_nrzi_pre_dmdp //
+// -------------------- //
+
+#define usb_tx_nrzi_pre_dmdp_wrap_target 0
+#define usb_tx_nrzi_pre_dmdp_wrap 26
+#define usb_tx_nrzi_pre_dmdp_offset_se0 9u
+#define usb_tx_nrzi_pre_dmdp_offset_release 13u
+#define usb_tx_nrzi_pre_dmdp_offset_idle 14u
+#define usb_tx_nrzi_pre_dmdp_offset_start 19u
+
+static const uint16_t __not_in_flash("tx_program") usb_tx_nrzi_pre_dmdp_program_instructions[] = {
+            //     .wrap_target
+    0x0003, //  0: jmp    3                          
+    0x0346, //  1: jmp    x--, 6                 [3] 
+    0x0403, //  2: jmp    3                      [4] 
+    0xa0ce, //  3: mov    isr, !isr                  
+    0xa006, //  4: mov    pins, isr                  
+    0xe025, //  5: set    x, 5                       
+    0x00ef, //  6: jmp    !osre, 15                  
+    0x0091, //  7: jmp    y--, 17                    
+    0xc300, //  8: irq    nowait 0               [3] 
+    0xef02, //  9: set    pins, 2                [15] 
+    0xe502, // 10: set    pins, 2                [5] 
+    0xa025, // 11: mov    x, status                  
+    0x0035, // 12: jmp    !x, 21                     
+    0xe080, // 13: set    pindirs, 0                 
+    0x000e, // 14: jmp    14                         
+    0xa142, // 15: nop                           [1] 
+    0x60a1, // 16: out    pc, 1                      
+    0x80a0, // 17: pull   block                      
+    0x60a1, // 18: out    pc, 1                      
+    0xe002, // 19: set    pins, 2                    
+    0xe083, // 20: set    pindirs, 3                 
+    0xe022, // 21: set    x, 2                       
+    0xa0c1, // 22: mov    isr, x                     
+    0x80a0, // 23: pull   block                      
+    0x6048, // 24: out    y, 8                       
+    0x0091, // 25: jmp    y--, 17                    
+    0x0008, // 26: jmp    8                          
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program __not_in_flash("tx_program") usb_tx_nrzi_pre_dmdp_program = {
+    .instructions = usb_tx_nrzi_pre_dmdp_program_instructions,
+    .length = 27,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_tx_nrzi_pre_dmdp_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_tx_nrzi_pre_dmdp_wrap_target, offset + usb_tx_nrzi_pre_dmdp_wrap);
+    return c;
+}
 
 #include "hardware/clocks.h"
 #include "sdk_compat.h"
@@ -190,6 +421,27 @@ static inline pio_sm_config usb_tx_pre_dmdp_program_get_default_config(uint offs
     usb_tx_configure_pins(pio, sm, pin_dp, pin_dm);
     pio_sm_set_enabled(pio, sm, true);
   }
+  static inline void usb_tx_nrzi_fs_program_init(PIO pio, uint sm, uint offset,
+                                              uint pin_dp, uint pin_dm) {
+    pio_sm_set_pins_with_mask64(pio, sm, (1ull << pin_dp), ((1ull << pin_dp) | (1ull << pin_dm)));
+    gpio_pull_down(pin_dp);
+    gpio_pull_down(pin_dm);
+    pio_gpio_init(pio, pin_dp);
+    pio_gpio_init(pio, pin_dm);
+    pio_sm_config c = usb_tx_nrzi_dpdm_program_get_default_config(offset);
+    // shifts to right, no autopull, 8bit
+    sm_config_set_out_shift(&c, true, false, 8);
+    // mov status is all ones if TX FIFO is empty
+    sm_config_set_mov_status(&c, STATUS_TX_LESSTHAN, 1);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+    // run at 96MHz
+    // clk_sys should be multiply of 12MHz
+    float div = (float)clock_get_hz(clk_sys) / (96000000UL);
+    sm_config_set_clkdiv(&c, div);
+    pio_sm_init(pio, sm, offset + usb_tx_nrzi_dpdm_offset_idle, &c);
+    usb_tx_configure_pins(pio, sm, pin_dp, pin_dm);
+    pio_sm_set_enabled(pio, sm, true);
+  }
 
 #endif
 
@@ -0,0 +1,39 @@
+#include "sdk_stub.h"
+
+pio_hw_t host_pio[2];
+
+static dma_hw_t host_dma;
+dma_hw_t *dma_hw = &host_dma;
+
+static timer_hw_t host_timer;
+timer_hw_t *timer_hw = &host_timer;
+
+void host_timer_set_us(uint32_t us) {
+  *(volatile uint32_t *)&host_timer.timerawl = us;
+}
+
+static pads_bank0_hw_t host_pads_bank0;
+pads_bank0_hw_t *pads_bank0_hw = &host_pads_bank0;
+
+interp_hw_t host_interp[2];
+
+spin_lock_t host_spin_lock[32];
+
+static uintptr_t interp_lane_result(interp_hw_t *interp, uint lane) {
+  uint32_t const ctrl = interp->ctrl[lane];
+  uint const shift = ctrl & 0x1f;
+  uint const mask_lsb = (ctrl >> 5) & 0x1f;
+  uint const mask_msb = (ctrl >> 10) & 0x1f;
+  bool const cross_input = ctrl & (1u << 16);
+  uint32_t const mask =
+      (uint32_t)((2ull << mask_msb) - (1ull << mask_lsb));
+
+  uint32_t const input = (uint32_t)interp->accum[cross_input ? 1 - lane : lane];
+  return interp->base[lane] + ((input >> shift) & mask);
+}
+
+interp_hw_t *host_interp_update(interp_hw_t *interp) {
+  interp->peek[0] = interp_lane_result(interp, 0);
+  interp->peek[1] = interp_lane_result(interp, 1);
+  return interp;
+}
@@ -0,0 +1,508 @@
+// Minimal stand-in of pico-sdk to build the library sources on the host.
+// Hardware access goes to plain memory, so only the code paths which do not
+// wait for the hardware (encoder, CRC, endpoint bookkeeping) are usable.
+
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int uint;
+typedef volatile uint32_t io_rw_32;
+typedef volatile uint8_t io_rw_8;
+typedef const volatile uint32_t io_ro_32;
+typedef volatile uint32_t io_wo_32;
+
+#define PICO_SDK_VERSION_MAJOR 2
+#define PICO_SDK_VERSION_MINOR 1
+
+//--------------------------------------------------------------------+
+// platform
+//--------------------------------------------------------------------+
+#define __not_in_flash(group)
+#define __not_in_flash_func(func) func
+#define __no_inline_not_in_flash_func(func) __attribute__((noinline)) func
+#define __time_critical_func(func) func
+#define __force_inline __attribute__((always_inline))
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+#define __unused __attribute__((unused))
+#define __scratch_x(group)
+#define __scratch_y(group)
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+static inline void tight_loop_contents(void) {}
+static inline void __compiler_memory_barrier(void) {
+  __asm volatile("" ::: "memory");
+}
+static inline uint get_core_num(void) { return 0; }
+
+static inline void hw_set_bits(io_rw_32 *addr, uint32_t mask) {
+  *addr |= mask;
+}
+static inline void hw_clear_bits(io_rw_32 *addr, uint32_t mask) {
+  *addr &= ~mask;
+}
+static inline void hw_write_masked(io_rw_32 *addr, uint32_t values,
+                                   uint32_t mask) {
+  *addr = (*addr & ~mask) | (values & mask);
+}
+
+#define SYSINFO_BASE 0x40000000
+#define SYSINFO_CHIP_ID_OFFSET 0
+#define SYSINFO_CHIP_ID_REVISION_BITS 0xf0000000
+#define SYSINFO_CHIP_ID_REVISION_LSB 28
+
+//--------------------------------------------------------------------+
+// pio
+//--------------------------------------------------------------------+
+typedef struct {
+  io_rw_32 clkdiv, execctrl, shiftctrl;
+  io_ro_32 addr;
+  io_rw_32 instr, pinctrl;
+} pio_sm_hw_t;
+
+typedef struct {
+  io_rw_32 ctrl;
+  io_ro_32 fstat;
+  io_rw_32 fdebug;
+  io_ro_32 flevel;
+  io_wo_32 txf[4];
+  io_ro_32 rxf[4];
+  io_rw_32 irq;
+  io_wo_32 irq_force;
+  io_rw_32 input_sync_bypass, dbg_padout, dbg_padoe, dbg_cfginfo;
+  io_wo_32 instr_mem[32];
+  pio_sm_hw_t sm[4];
+  io_rw_32 intr, inte0, intf0, ints0;
+} pio_hw_t;
+typedef pio_hw_t *PIO;
+
+typedef struct pio_program {
+  const uint16_t *instructions;
+  uint8_t length;
+  int8_t origin;
+} pio_program_t;
+
+typedef struct {
+  uint32_t clkdiv, execctrl, shiftctrl, pinctrl;
+} pio_sm_config;
+
+enum pio_fifo_join { PIO_FIFO_JOIN_NONE, PIO_FIFO_JOIN_TX, PIO_FIFO_JOIN_RX };
+enum pio_mov_status_type { STATUS_TX_LESSTHAN, STATUS_RX_LESSTHAN };
+enum pio_interrupt_source { pis_interrupt0 = 8 };
+enum pio_instr_bits {
+  pio_instr_bits_jmp = 0x0000,
+  pio_instr_bits_wait = 0x2000,
+  pio_instr_bits_in = 0x4000,
+  pio_instr_bits_out = 0x6000,
+  pio_instr_bits_push = 0x8000,
+  pio_instr_bits_pull = 0x8080,
+  pio_instr_bits_mov = 0xa000,
+  pio_instr_bits_irq = 0xc000,
+  pio_instr_bits_set = 0xe000,
+};
+enum pio_src_dest {
+  pio_pins = 0,
+  pio_x = 1,
+  pio_y = 2,
+  pio_null = 3,
+  pio_pindirs = 4,
+  pio_exec_mov = 4,
+  pio_status = 5,
+  pio_pc = 5,
+  pio_isr = 6,
+  pio_osr = 7,
+  pio_exec_out = 7,
+};
+
+#define PIO_FDEBUG_TXSTALL_LSB 24
+#define PIO_FDEBUG_RXSTALL_LSB 0
+#define PIO_SM0_EXECCTRL_JMP_PIN_BITS 0x1f000000
+#define PIO_SM0_EXECCTRL_JMP_PIN_LSB 24
+#define PIO_SM0_SHIFTCTRL_PUSH_THRESH_BITS 0x01f00000
+#define PIO_SM0_SHIFTCTRL_PUSH_THRESH_LSB 20
+#define PIO0_BASE 0x50200000
+#define PIO1_BASE 0x50300000
+#define PIO0_IRQ_0 7
+#define NUM_PIO_IRQS 2
+
+extern pio_hw_t host_pio[2];
+static inline PIO pio_get_instance(uint instance) {
+  return &host_pio[instance];
+}
+#define PIO_NUM(pio) ((uint)((pio) - host_pio))
+#define PIO_IRQ_NUM(pio, irqn) \
+  (PIO0_IRQ_0 + NUM_PIO_IRQS * PIO_NUM(pio) + (irqn))
+
+static inline void pio_sm_exec(PIO pio, uint sm, uint instr) {
+  pio->sm[sm].instr = instr;
+}
+static inline uint32_t pio_sm_get(PIO pio, uint sm) { return pio->rxf[sm]; }
+static inline uint32_t pio_sm_get_blocking(PIO pio, uint sm) {
+  return pio->rxf[sm];
+}
+static inline void pio_sm_put(PIO pio, uint sm, uint32_t data) {
+  pio->txf[sm] = data;
+}
+static inline void pio_sm_put_blocking(PIO pio, uint sm, uint32_t data) {
+  pio->txf[sm] = data;
+}
+static inline uint pio_sm_get_rx_fifo_level(PIO pio, uint sm) {
+  return (pio->flevel >> (sm * 8 + 4)) & 0xf;
+}
+static inline uint pio_sm_get_tx_fifo_level(PIO pio, uint sm) {
+  return (pio->flevel >> (sm * 8)) & 0xf;
+}
+static inline bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm) {
+  return pio->fstat & (1u << (8 + sm));
+}
+static inline bool pio_sm_is_tx_fifo_empty(PIO pio, uint sm) {
+  return pio->fstat & (1u << (24 + sm));
+}
+static inline void pio_sm_set_clkdiv_int_frac(PIO pio, uint sm, uint16_t div_int,
+                                              uint8_t div_frac) {
+  pio->sm[sm].clkdiv = ((uint32_t)div_int << 16) | ((uint32_t)div_frac << 8);
+}
+static inline void pio_calculate_clkdiv_from_float(float div, uint16_t *div_int,
+                                                   uint8_t *div_frac) {
+  *div_int = (uint16_t)div;
+  *div_frac = 0;
+}
+static inline pio_sm_config pio_get_default_sm_config(void) {
+  pio_sm_config c = {0};
+  return c;
+}
+static inline uint pio_encode_wait_irq(bool polarity, bool relative, uint irq) {
+  return 0x2000 | ((uint)polarity << 7) | (2 << 5) | (relative ? 0x10 : 0) |
+         irq;
+}
+static inline uint _pio_major_instr_bits(uint instr) { return instr & 0xe000; }
+static inline uint pio_encode_jmp(uint addr) { return addr; }
+static inline uint pio_encode_jmp_not_x(uint addr) { return 0x20 | addr; }
+static inline uint pio_encode_set(enum pio_src_dest dest, uint value) {
+  return 0xe000 | (dest << 5) | value;
+}
+static inline uint pio_encode_mov(enum pio_src_dest dest,
+                                  enum pio_src_dest src) {
+  return 0xa000 | (dest << 5) | src;
+}
+static inline uint pio_encode_mov_not(enum pio_src_dest dest,
+                                      enum pio_src_dest src) {
+  return 0xa008 | (dest << 5) | src;
+}
+static inline uint pio_encode_in(enum pio_src_dest src, uint count) {
+  return 0x4000 | (src << 5) | (count & 31);
+}
+static inline uint pio_encode_out(enum pio_src_dest dest, uint count) {
+  return 0x6000 | (dest << 5) | (count & 31);
+}
+static inline uint pio_encode_push(bool if_full, bool block) {
+  return 0x8000 | (if_full << 6) | (block << 5);
+}
+static inline uint pio_encode_pull(bool if_empty, bool block) {
+  return 0x8080 | (if_empty << 6) | (block << 5);
+}
+static inline uint pio_encode_irq_set(bool relative, uint irq) {
+  (void)relative;
+  return 0xc000 | irq;
+}
+static inline uint pio_encode_irq_clear(bool relative, uint irq) {
+  (void)relative;
+  return 0xc040 | irq;
+}
+static inline uint pio_encode_nop(void) { return 0xa042; }
+static inline uint pio_encode_delay(uint cycles) { return cycles << 8; }
+static inline uint pio_encode_sideset(uint bit_count, uint value) {
+  return value << (13 - bit_count);
+}
+static inline uint pio_encode_sideset_opt(uint bit_count, uint value) {
+  return 0x1000 | value << (12 - bit_count);
+}
+
+// Configuration calls have no effect
+static inline void host_stub_nop(int dummy, ...) { (void)dummy; }
+
+#define pio_sm_set_enabled(pio, sm, enabled) host_stub_nop(0, pio, sm, enabled)
+#define pio_sm_clear_fifos(pio, sm) host_stub_nop(0, pio, sm)
+#define pio_sm_restart(pio, sm) host_stub_nop(0, pio, sm)
+#define pio_sm_clkdiv_restart(pio, sm) host_stub_nop(0, pio, sm)
+#define pio_sm_set_clkdiv(pio, sm, div) host_stub_nop(0, pio, sm, div)
+#define pio_add_program(pio, program) (host_stub_nop(0, pio, program), 0u)
+#define pio_add_program_at_offset(pio, program, offset) \
+  host_stub_nop(0, pio, program, offset)
+#define pio_can_add_program(pio, program) (host_stub_nop(0, pio, program), true)
+#define pio_can_add_program_at_offset(pio, program, offset) \
+  (host_stub_nop(0, pio, program, offset), true)
+#define pio_remove_program(pio, program, offset) \
+  host_stub_nop(0, pio, program, offset)
+#define pio_sm_claim(pio, sm) host_stub_nop(0, pio, sm)
+#define pio_claim_unused_sm(pio, required) (host_stub_nop(0, pio, required), 3)
+#define pio_get_dreq(pio, sm, is_tx) ((sm) + ((is_tx) ? 0 : 4))
+#define pio_sm_set_jmp_pin(pio, sm, pin) host_stub_nop(0, pio, sm, pin)
+#define pio_sm_set_in_pins(pio, sm, pin) host_stub_nop(0, pio, sm, pin)
+#define pio_sm_set_out_pins(pio, sm, pin, count) \
+  host_stub_nop(0, pio, sm, pin, count)
+#define pio_sm_set_set_pins(pio, sm, pin, count) \
+  host_stub_nop(0, pio, sm, pin, count)
+#define pio_sm_set_sideset_pins(pio, sm, pin) host_stub_nop(0, pio, sm, pin)
+#define pio_sm_set_consecutive_pindirs(pio, sm, pin, count, out) \
+  host_stub_nop(0, pio, sm, pin, count, out)
+#define pio_sm_set_pins_with_mask64(pio, sm, values, mask) \
+  host_stub_nop(0, pio, sm, values, mask)
+#define pio_sm_set_pindirs_with_mask64(pio, sm, values, mask) \
+  host_stub_nop(0, pio, sm, values, mask)
+#define pio_sm_set_wrap(pio, sm, target, wrap) \
+  host_stub_nop(0, pio, sm, target, wrap)
+#define pio_set_irqn_source_enabled(pio, irqn, source, enabled) \
+  host_stub_nop(0, pio, irqn, source, enabled)
+#define pio_gpio_init(pio, pin) host_stub_nop(0, pio, pin)
+#define pio_set_gpio_base(pio, base) host_stub_nop(0, pio, base)
+#define pio_sm_init(pio, sm, offset, config) \
+  host_stub_nop(0, pio, sm, offset, config)
+#define sm_config_set_wrap(c, target, wrap) host_stub_nop(0, c, target, wrap)
+#define sm_config_set_sideset(c, count, optional, pindirs) \
+  host_stub_nop(0, c, count, optional, pindirs)
+#define sm_config_set_sideset_pins(c, pin) host_stub_nop(0, c, pin)
+#define sm_config_set_in_pins(c, pin) host_stub_nop(0, c, pin)
+#define sm_config_set_jmp_pin(c, pin) host_stub_nop(0, c, pin)
+#define sm_config_set_out_pins(c, pin, count) host_stub_nop(0, c, pin, count)
+#define sm_config_set_set_pins(c, pin, count) host_stub_nop(0, c, pin, count)
+#define sm_config_set_in_shift(c, right, autopush, threshold) \
+  host_stub_nop(0, c, right, autopush, threshold)
+#define sm_config_set_out_shift(c, right, autopull, threshold) \
+  host_stub_nop(0, c, right, autopull, threshold)
+#define sm_config_set_fifo_join(c, join) host_stub_nop(0, c, join)
+#define sm_config_set_clkdiv(c, div) host_stub_nop(0, c, div)
+#define sm_config_set_mov_status(c, type, n) host_stub_nop(0, c, type, n)
+
+//--------------------------------------------------------------------+
+// dma
+//--------------------------------------------------------------------+
+typedef struct {
+  uint32_t ctrl;
+} dma_channel_config;
+
+enum dma_channel_transfer_size { DMA_SIZE_8, DMA_SIZE_16, DMA_SIZE_32 };
+
+typedef struct {
+  io_rw_32 read_addr, write_addr, transfer_count, ctrl_trig;
+  io_rw_32 al1_ctrl, al1_read_addr, al1_write_addr, al1_transfer_count_trig;
+  io_rw_32 al2_ctrl, al2_transfer_count, al2_read_addr, al2_write_addr_trig;
+  io_rw_32 al3_ctrl, al3_write_addr, al3_transfer_count, al3_read_addr_trig;
+} dma_channel_hw_t;
+
+typedef struct {
+  dma_channel_hw_t ch[12];
+  io_rw_32 multi_channel_trigger;
+  io_rw_32 abort;
+} dma_hw_t;
+
+extern dma_hw_t *dma_hw;
+static inline dma_channel_hw_t *dma_channel_hw_addr(uint channel) {
+  return &dma_hw->ch[channel];
+}
+static inline dma_channel_config dma_channel_get_default_config(uint channel) {
+  (void)channel;
+  dma_channel_config c = {0};
+  return c;
+}
+static inline uint32_t
+channel_config_get_ctrl_value(const dma_channel_config *c) {
+  return c->ctrl;
+}
+
+#define channel_config_set_read_increment(c, incr) host_stub_nop(0, c, incr)
+#define channel_config_set_write_increment(c, incr) host_stub_nop(0, c, incr)
+#define channel_config_set_transfer_data_size(c, size) host_stub_nop(0, c, size)
+#define channel_config_set_dreq(c, dreq) host_stub_nop(0, c, dreq)
+#define channel_config_set_chain_to(c, channel) host_stub_nop(0, c, channel)
+#define channel_config_set_ring(c, write, size_bits) \
+  host_stub_nop(0, c, write, size_bits)
+#define channel_config_set_irq_quiet(c, quiet) host_stub_nop(0, c, quiet)
+#define channel_config_set_enable(c, enable) host_stub_nop(0, c, enable)
+#define dma_channel_set_config(channel, c, trigger) \
+  host_stub_nop(0, channel, c, trigger)
+#define dma_channel_configure(channel, c, write, read, count, trigger) \
+  host_stub_nop(0, channel, c, write, read, count, trigger)
+#define dma_channel_set_write_addr(channel, write, trigger) \
+  host_stub_nop(0, channel, write, trigger)
+#define dma_channel_set_read_addr(channel, read, trigger) \
+  host_stub_nop(0, channel, read, trigger)
+#define dma_channel_set_trans_count(channel, count, trigger) \
+  host_stub_nop(0, channel, count, trigger)
+#define dma_channel_transfer_from_buffer_now(channel, read, count) \
+  host_stub_nop(0, channel, read, count)
+#define dma_channel_transfer_to_buffer_now(channel, write, count) \
+  host_stub_nop(0, channel, write, count)
+#define dma_channel_start(channel) host_stub_nop(0, channel)
+#define dma_channel_abort(channel) host_stub_nop(0, channel)
+#define dma_channel_is_busy(channel) (host_stub_nop(0, channel), false)
+#define dma_channel_wait_for_finish_blocking(channel) host_stub_nop(0, channel)
+#define dma_claim_mask(mask) host_stub_nop(0, mask)
+#define dma_channel_claim(channel) host_stub_nop(0, channel)
+#define dma_claim_unused_channel(required) (host_stub_nop(0, required), 1)
+#define dma_start_channel_mask(mask) host_stub_nop(0, mask)
+
+//--------------------------------------------------------------------+
+// gpio, clocks, irq
+//--------------------------------------------------------------------+
+enum gpio_slew_rate { GPIO_SLEW_RATE_SLOW, GPIO_SLEW_RATE_FAST };
+enum gpio_drive_strength { GPIO_DRIVE_STRENGTH_2MA, GPIO_DRIVE_STRENGTH_12MA = 3 };
+enum {
+  GPIO_OVERRIDE_NORMAL,
+  GPIO_OVERRIDE_INVERT,
+  GPIO_OVERRIDE_LOW,
+  GPIO_OVERRIDE_HIGH,
+};
+
+typedef struct {
+  io_rw_32 io[48];
+} pads_bank0_hw_t;
+extern pads_bank0_hw_t *pads_bank0_hw;
+#define PADS_BANK0_GPIO0_IE_BITS 0x40
+
+#define gpio_set_slew_rate(pin, rate) host_stub_nop(0, pin, rate)
+#define gpio_set_drive_strength(pin, strength) host_stub_nop(0, pin, strength)
+#define gpio_pull_up(pin) host_stub_nop(0, pin)
+#define gpio_pull_down(pin) host_stub_nop(0, pin)
+#define gpio_disable_pulls(pin) host_stub_nop(0, pin)
+#define gpio_set_inover(pin, value) host_stub_nop(0, pin, value)
+#define gpio_set_outover(pin, value) host_stub_nop(0, pin, value)
+#define gpio_set_oeover(pin, value) host_stub_nop(0, pin, value)
+#define gpio_get(pin) (host_stub_nop(0, pin), false)
+#define gpio_set_mask(mask) host_stub_nop(0, mask)
+#define gpio_clr_mask(mask) host_stub_nop(0, mask)
+
+enum clock_index { clk_sys = 5 };
+#define clock_get_hz(clk) (120000000u)
+
+typedef void (*irq_handler_t)(void);
+#define irq_set_exclusive_handler(num, handler) host_stub_nop(0, num, handler)
+#define irq_set_enabled(num, enabled) host_stub_nop(0, num, enabled)
+#define irq_clear(num) host_stub_nop(0, num)
+
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void)status; }
+
+typedef volatile uint32_t spin_lock_t;
+extern spin_lock_t host_spin_lock[32];
+static inline int spin_lock_claim_unused(bool required) {
+  (void)required;
+  return 0;
+}
+static inline spin_lock_t *spin_lock_instance(uint lock_num) {
+  return &host_spin_lock[lock_num];
+}
+static inline uint32_t spin_lock_blocking(spin_lock_t *lock) {
+  *lock = 1;
+  return 0;
+}
+static inline void spin_unlock(spin_lock_t *lock, uint32_t saved_irq) {
+  (void)saved_irq;
+  *lock = 0;
+}
+
+//--------------------------------------------------------------------+
+// time
+//--------------------------------------------------------------------+
+typedef struct {
+  io_rw_32 timehw, timelw;
+  io_ro_32 timehr, timelr;
+  io_rw_32 alarm[4], armed;
+  io_ro_32 timerawh, timerawl;
+} timer_hw_t;
+extern timer_hw_t *timer_hw;
+#define PICO_DEFAULT_TIMER_INSTANCE() timer_hw
+void host_timer_set_us(uint32_t us); // time read by the library
+
+static inline uint32_t time_us_32(void) { return timer_hw->timerawl; }
+
+typedef uint64_t absolute_time_t;
+static inline absolute_time_t get_absolute_time(void) { return 0; }
+static inline int64_t absolute_time_diff_us(absolute_time_t from,
+                                            absolute_time_t to) {
+  return (int64_t)(to - from);
+}
+
+#define busy_wait_us(us) host_stub_nop(0, us)
+#define busy_wait_us_32(us) host_stub_nop(0, us)
+#define busy_wait_ms(ms) host_stub_nop(0, ms)
+#define busy_wait_at_least_cycles(cycles) host_stub_nop(0, cycles)
+#define sleep_ms(ms) host_stub_nop(0, ms)
+
+typedef struct alarm_pool alarm_pool_t;
+typedef struct repeating_timer repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t *rt);
+struct repeating_timer {
+  int64_t delay_us;
+  alarm_pool_t *pool;
+  int32_t alarm_id;
+  repeating_timer_callback_t callback;
+  void *user_data;
+};
+#define alarm_pool_create(alarm_num, max_timers) \
+  (host_stub_nop(0, alarm_num, max_timers), (alarm_pool_t *)NULL)
+static inline bool alarm_pool_add_repeating_timer_us(
+    alarm_pool_t *pool, int64_t delay_us, repeating_timer_callback_t callback,
+    void *user_data, repeating_timer_t *out) {
+  host_stub_nop(0, pool, delay_us, callback, user_data, out);
+  return true;
+}
+static inline bool cancel_repeating_timer(repeating_timer_t *timer) {
+  (void)timer;
+  return true;
+}
+
+#define reset_usb_boot(gpio_mask, disable_mask) \
+  host_stub_nop(0, gpio_mask, disable_mask)
+static inline bool set_sys_clock_khz(uint32_t freq_khz, bool required) {
+  host_stub_nop(0, freq_khz, required);
+  return true;
+}
+static inline bool stdio_init_all(void) { return true; }
+
+//--------------------------------------------------------------------+
+// interp
+//--------------------------------------------------------------------+
+// Lane results are recalculated whenever interp0/interp1 is evaluated, so
+// peek[] reflects the accumulators written before. Registers are pointer
+// sized to hold host addresses in base[].
+typedef struct {
+  uintptr_t accum[2];
+  uintptr_t base[3];
+  uintptr_t pop[3];
+  uintptr_t peek[3];
+  uint32_t ctrl[2];
+} interp_hw_t;
+
+extern interp_hw_t host_interp[2];
+interp_hw_t *host_interp_update(interp_hw_t *interp);
+#define interp0 (host_interp_update(&host_interp[0]))
+#define interp1 (host_interp_update(&host_interp[1]))
+
+typedef struct {
+  uint32_t ctrl;
+} interp_config;
+
+static inline interp_config interp_default_config(void) {
+  interp_config c = {31u << 10}; // mask msb 31
+  return c;
+}
+static inline void interp_config_set_shift(interp_config *c, uint shift) {
+  c->ctrl = (c->ctrl & ~0x1fu) | shift;
+}
+static inline void interp_config_set_mask(interp_config *c, uint mask_lsb,
+                                          uint mask_msb) {
+  c->ctrl = (c->ctrl & ~0x7fe0u) | (mask_lsb << 5) | (mask_msb << 10);
+}
+static inline void interp_config_set_cross_input(interp_config *c, bool cross) {
+  c->ctrl = (c->ctrl & ~(1u << 16)) | ((uint32_t)cross << 16);
+}
+static inline void interp_set_config(interp_hw_t *interp, uint lane,
+                                     interp_config *c) {
+  interp->ctrl[lane] = c->ctrl;
+}
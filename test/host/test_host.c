@@ -0,0 +1,809 @@
+// Golden tests of TX encoder, CRC and token encoding, and behavior tests of
+// host scheduling on the host. Build options under test are given by compile
+// definitions, see CMakeLists.txt.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pico/stdlib.h"
+#include "pio_usb.h"
+#include "pio_usb_configuration.h"
+#include "pio_usb_ll.h"
+#include "usb_crc.h"
+#include "usb_definitions.h"
+
+// Built into this file, so that static scheduling helpers can be tested
+#include "pio_usb_host.c"
+
+// Bit-by-bit CRC used as reference for calc_usb_crc5()
+static uint8_t calc_usb_crc5_reference(uint16_t data) {
+  uint8_t crc = 0x1f;
+  for (int b = 0; b < 11; b++) {
+    bool const bit = ((data >> b) ^ crc) & 0x01;
+    crc >>= 1;
+    if (bit) {
+      crc ^= 0x14; // x^5 + x^2 + 1, reflected
+    }
+  }
+  return crc ^ 0x1f;
+}
+
+// Bit-by-bit CRC used as reference for calc_usb_crc16()
+static uint16_t calc_usb_crc16_reference(uint8_t const *data, uint16_t len) {
+  uint16_t crc = 0xffff;
+  for (uint16_t idx = 0; idx < len; idx++) {
+    for (int b = 0; b < 8; b++) {
+      bool const bit = ((data[idx] >> b) ^ crc) & 0x01;
+      crc >>= 1;
+      if (bit) {
+        crc ^= 0xa001; // x^16 + x^15 + x^2 + 1, reflected
+      }
+    }
+  }
+  return crc ^ 0xffff;
+}
+
+#if PIO_USB_TX_ENCODE_IN_PIO
+// TX state machine encodes raw packet which follows its length
+static uint16_t encode_tx_data_reference(uint8_t const *buffer,
+                                         uint16_t buffer_len,
+                                         uint8_t *encoded_data) {
+  encoded_data[0] = buffer_len;
+  memcpy(encoded_data + 1, buffer, buffer_len);
+  return buffer_len + 1;
+}
+#else
+// Bit-by-bit NRZI encoder used as reference for pio_usb_ll_encode_tx_data()
+static uint16_t encode_tx_data_reference(uint8_t const *buffer,
+                                         uint16_t buffer_len,
+                                         uint8_t *encoded_data) {
+  uint32_t bit_idx = 0;
+  int current_state = 1;
+  int bit_stuffing = 6;
+
+#define PUT_SYMBOL(sym)                                     \
+  do {                                                      \
+    encoded_data[bit_idx >> 2] =                            \
+        (encoded_data[bit_idx >> 2] << 2) | (sym);          \
+    bit_idx++;                                              \
+  } while (0)
+#define PUT_TRANSITION()                                    \
+  do {                                                      \
+    PUT_SYMBOL(current_state ? PIO_USB_TX_ENCODED_DATA_J    \
+                             : PIO_USB_TX_ENCODED_DATA_K);  \
+    current_state ^= 1;                                     \
+  } while (0)
+
+  for (uint16_t idx = 0; idx < buffer_len; idx++) {
+    for (int b = 0; b < 8; b++) {
+      if (buffer[idx] & (1 << b)) {
+        PUT_SYMBOL(current_state ? PIO_USB_TX_ENCODED_DATA_K
+                                 : PIO_USB_TX_ENCODED_DATA_J);
+        bit_stuffing--;
+      } else {
+        PUT_TRANSITION();
+        bit_stuffing = 6;
+      }
+
+      if (bit_stuffing == 0) {
+        PUT_TRANSITION();
+        bit_stuffing = 6;
+      }
+    }
+  }
+
+  PUT_SYMBOL(PIO_USB_TX_ENCODED_DATA_SE0);
+  PUT_SYMBOL(PIO_USB_TX_ENCODED_DATA_COMP);
+  do {
+    PUT_SYMBOL(PIO_USB_TX_ENCODED_DATA_K);
+  } while (bit_idx & 0x03);
+
+#undef PUT_TRANSITION
+#undef PUT_SYMBOL
+
+  return bit_idx >> 2;
+}
+#endif
+
+static bool compare_encode(uint8_t const *buffer, uint8_t len) {
+  uint8_t expect[PIO_USB_TX_ENCODED_LEN(PIO_USB_EP_SIZE + 4)];
+  uint8_t encoded[PIO_USB_TX_ENCODED_LEN(PIO_USB_EP_SIZE + 4)];
+  uint16_t const expect_len = encode_tx_data_reference(buffer, len, expect);
+  uint16_t const encoded_len = pio_usb_ll_encode_tx_data(buffer, len, encoded);
+
+  if (expect_len != encoded_len || memcmp(expect, encoded, expect_len) != 0) {
+    printf("\t[NG] Encode mismatch, length %d\n", len);
+    return false;
+  }
+  return true;
+}
+
+static bool do_encode_test(void) {
+  bool success = true;
+  uint8_t buffer[PIO_USB_EP_SIZE + 4];
+
+  // worst case bit stuffing
+  memset(buffer, 0xff, sizeof(buffer));
+  for (size_t len = 0; len <= sizeof(buffer); len++) {
+    success &= compare_encode(buffer, len);
+  }
+
+  // every byte after every length of preceding run of 1
+  for (int run = 0; run < 8; run++) {
+    for (int data = 0; data < 256; data++) {
+      buffer[0] = 0xff << (8 - run);
+      buffer[1] = data;
+      buffer[2] = 0xff;
+      success &= compare_encode(buffer, 3);
+    }
+  }
+
+  // pseudo random data, with long runs of 1 mixed in
+  uint32_t seed = 1;
+  for (int i = 0; i < 10000; i++) {
+    uint8_t len = i % (sizeof(buffer) + 1);
+    for (size_t j = 0; j < len; j++) {
+      seed = seed * 1103515245 + 12345;
+      uint8_t rnd = seed >> 16;
+      buffer[j] = (seed & 0x100) ? rnd : (rnd | 0xf0);
+    }
+    success &= compare_encode(buffer, len);
+  }
+
+  return success;
+}
+
+static bool do_crc_token_test(void) {
+  bool success = true;
+
+  // Examples of "CRC in USB" white paper, bits are in transmission order
+  static const struct {
+    uint16_t data;
+    uint8_t crc;
+  } crc5_vectors[] = {
+      {0x715, 0x1d}, // addr 0x15, endp 0xe
+      {0x53a, 0x07}, // addr 0x3a, endp 0xa
+      {0x710, 0x05}, // frame 0x710
+  };
+  for (size_t i = 0; i < sizeof(crc5_vectors) / sizeof(crc5_vectors[0]); i++) {
+    if (calc_usb_crc5(crc5_vectors[i].data) != crc5_vectors[i].crc) {
+      printf("\t[NG] CRC5 of %03x\n", crc5_vectors[i].data);
+      success = false;
+    }
+  }
+  for (uint16_t data = 0; data < 0x800; data++) {
+    if (calc_usb_crc5(data) != calc_usb_crc5_reference(data)) {
+      printf("\t[NG] CRC5 mismatch %03x\n", data);
+      success = false;
+    }
+  }
+
+  static const uint8_t crc16_data0[] = {0x00, 0x01, 0x02, 0x03};
+  static const uint8_t crc16_data1[] = {0x23, 0x45, 0x67, 0x89};
+  if (calc_usb_crc16(crc16_data0, sizeof(crc16_data0)) != 0x7aef ||
+      calc_usb_crc16(crc16_data1, sizeof(crc16_data1)) != 0x1c0e) {
+    printf("\t[NG] CRC16 of white paper examples\n");
+    success = false;
+  }
+
+  usb_crc16_interp_init();
+  uint8_t buffer[PIO_USB_EP_SIZE];
+  uint32_t seed = 1;
+  for (int i = 0; i < 2000; i++) {
+    uint8_t len = i % (sizeof(buffer) + 1);
+    uint16_t crc = 0xffff;
+    uint16_t crc_nibble = 0xffff;
+    uint16_t crc_interp = 0xffff;
+    for (size_t j = 0; j < len; j++) {
+      seed = seed * 1103515245 + 12345;
+      buffer[j] = seed >> 16;
+      crc = update_usb_crc16(crc, buffer[j]);
+      crc_nibble = update_usb_crc16_nibble(crc_nibble, buffer[j]);
+      crc_interp = update_usb_crc16_interp(crc_interp, buffer[j]);
+    }
+    crc ^= 0xffff;
+    crc_nibble ^= 0xffff;
+    crc_interp ^= 0xffff;
+    uint16_t const expect = calc_usb_crc16_reference(buffer, len);
+    if (calc_usb_crc16(buffer, len) != expect || crc != expect ||
+        calc_usb_crc16_nibble(buffer, len) != expect || crc_nibble != expect ||
+        calc_usb_crc16_slice4(buffer, len) != expect ||
+        calc_usb_crc16_interp(buffer, len) != expect || crc_interp != expect) {
+      printf("\t[NG] CRC16 mismatch, length %d\n", len);
+      success = false;
+    }
+  }
+
+  // IN token to addr 0x15, endp 0xe
+  static const uint8_t in_token[] = {USB_SYNC, USB_PID_IN, 0x15, 0xef};
+  uint8_t expect[PIO_USB_TX_TOKEN_ROOM];
+  uint16_t const expect_len =
+      encode_tx_data_reference(in_token, sizeof(in_token), expect);
+  uint8_t token_encoded[EP_TOKEN_CNT][PIO_USB_TX_TOKEN_ROOM];
+  endpoint_t ep = {0};
+  ep.dev_addr = 0x15;
+  ep.ep_num = 0x8e;
+  ep.token_encoded = token_encoded;
+  pio_usb_ll_encode_token(&ep);
+  if (ep.token_encoded_len[EP_TOKEN_IN] != expect_len ||
+      memcmp(ep.token_encoded[EP_TOKEN_IN], expect, expect_len) != 0) {
+    printf("\t[NG] IN token mismatch\n");
+    success = false;
+  }
+
+  return success;
+}
+
+// Check encoded DATA packet of current transaction against SYNC, PID, data
+// and CRC16 encoded by the reference
+static bool compare_data_packet(endpoint_t *ep, uint8_t const *data,
+                                uint16_t len, uint8_t pid) {
+  uint8_t packet[PIO_USB_EP_SIZE + 4];
+  uint8_t expect[PIO_USB_TX_ENCODED_LEN(PIO_USB_EP_SIZE + 4)];
+
+  packet[0] = USB_SYNC;
+  packet[1] = pid;
+  memcpy(packet + 2, data, len);
+  uint16_t const crc = calc_usb_crc16_reference(data, len);
+  packet[2 + len] = crc & 0xff;
+  packet[3 + len] = crc >> 8;
+  uint16_t const expect_len =
+      encode_tx_data_reference(packet, len + 4, expect);
+
+  if (pio_usb_ll_get_tx_data_len(ep) != expect_len ||
+      memcmp(pio_usb_ll_get_tx_data(ep), expect, expect_len) != 0) {
+    printf("\t[NG] DATA packet mismatch, offset %d length %d\n",
+           ep->actual_len, len);
+    return false;
+  }
+  return true;
+}
+
+static bool run_data_transfer(endpoint_t *ep, uint8_t *data, uint16_t len) {
+  bool success = true;
+
+  ep->data_id = 0;
+  if (!pio_usb_ll_transfer_start(ep, data, len)) {
+    printf("\t[NG] Transfer start, length %d\n", len);
+    return false;
+  }
+
+  uint8_t pid = USB_PID_DATA0;
+  do {
+    uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
+    success &= compare_data_packet(ep, ep->app_buf, xact_len, pid);
+    pio_usb_ll_prepare_next_tx(ep);
+    pid = (pid == USB_PID_DATA0) ? USB_PID_DATA1 : USB_PID_DATA0;
+    if (!pio_usb_ll_transfer_continue(ep, xact_len)) {
+      break;
+    }
+  } while (success);
+
+  return success;
+}
+
+static bool do_data_packet_test(void) {
+  static uint8_t ep_buffer[PIO_USB_EP_BUFFER_SIZE(PIO_USB_EP_SIZE, true)];
+  static uint8_t train[PIO_USB_TX_TRAIN_SIZE(PIO_USB_EP_SIZE * 3,
+                                             PIO_USB_EP_SIZE)];
+  uint8_t data[PIO_USB_EP_SIZE * 3];
+  bool success = true;
+
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (i * 37) ^ (i >> 3);
+  }
+
+  endpoint_t *ep = PIO_USB_ENDPOINT(0);
+  memset(ep, 0, sizeof(*ep));
+  ep->size = PIO_USB_EP_SIZE;
+  ep->is_tx = true;
+  ep->buffer[0] = ep_buffer;
+  ep->buffer[1] = (PIO_USB_TX_SLOT_CNT > 1)
+                      ? ep_buffer + sizeof(ep_buffer) / PIO_USB_TX_SLOT_CNT
+                      : NULL;
+
+  static const uint16_t lengths[] = {0, 1, 63, 64, 65, 128, 150, 192};
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    success &= run_data_transfer(ep, data, lengths[i]);
+  }
+
+  pio_usb_ll_set_tx_train(ep, train, sizeof(train));
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    success &= run_data_transfer(ep, data, lengths[i]);
+  }
+
+  memset(ep, 0, sizeof(*ep));
+  return success;
+}
+
+// A device behind a hub is replugged many times while the hub keeps its
+// endpoints open. Buffers of closed endpoints must be reused.
+static bool do_replug_test(void) {
+  static const uint8_t ep0_desc[] = {7, DESC_TYPE_ENDPOINT, 0x00,
+                                     EP_ATTR_CONTROL, 64, 0, 0};
+  static const uint8_t hub_desc[] = {7, DESC_TYPE_ENDPOINT, 0x81,
+                                     EP_ATTR_INTERRUPT, 1, 0, 12};
+  static const uint8_t in_desc[] = {7, DESC_TYPE_ENDPOINT, 0x81,
+                                    EP_ATTR_BULK, 64, 0, 0};
+  static const uint8_t out_desc[] = {7, DESC_TYPE_ENDPOINT, 0x02,
+                                     EP_ATTR_BULK, 64, 0, 0};
+  bool success = true;
+
+  if (!pio_usb_host_endpoint_open(0, 1, ep0_desc, false) ||
+      !pio_usb_host_endpoint_open(0, 1, hub_desc, false)) {
+    printf("\t[NG] Open hub\n");
+    return false;
+  }
+
+  for (int plug = 0; plug < 100 && success; plug++) {
+    if (!pio_usb_host_endpoint_open(0, 2, ep0_desc, false) ||
+        !pio_usb_host_endpoint_open(0, 2, in_desc, false) ||
+        !pio_usb_host_endpoint_open(0, 2, out_desc, false)) {
+      printf("\t[NG] Open device at replug %d\n", plug);
+      success = false;
+    }
+    pio_usb_host_close_device(0, 2);
+  }
+  pio_usb_host_close_device(0, 1);
+
+  // Device endpoints are re-opened at every SET_CONFIGURATION
+  endpoint_t *ep = pio_usb_device_get_endpoint_by_address(0x81);
+  for (int config = 0; config < 100 && success; config++) {
+    if (!pio_usb_device_endpoint_open(in_desc)) {
+      printf("\t[NG] Open device endpoint at configuration %d\n", config);
+      success = false;
+    }
+  }
+  pio_usb_ll_free_buffer(ep);
+  memset(ep, 0, sizeof(*ep));
+
+  return success;
+}
+
+static bool periodic_load_is_zero(void) {
+  for (int f = 0; f < PERIODIC_FRAMES; f++) {
+    if (periodic_load_us[f]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Interrupt and isochronous endpoints are spread over the phases of their
+// period, and closing one takes its bus time out of the schedule
+static bool do_periodic_schedule_test(void) {
+  root_port_t *root = PIO_USB_ROOT_PORT(0);
+  uint8_t desc[] = {7, DESC_TYPE_ENDPOINT, 0x81, EP_ATTR_INTERRUPT, 8, 0, 8};
+  bool success = true;
+
+  root->is_fullspeed = true; // isochronous endpoints need full-speed
+
+  static const struct {
+    uint8_t attr;
+    uint8_t interval;
+    uint8_t period;
+  } periods[] = {
+      {EP_ATTR_INTERRUPT, 1, 1},    {EP_ATTR_INTERRUPT, 10, 8},
+      {EP_ATTR_INTERRUPT, 255, 32}, {EP_ATTR_ISOCHRONOUS, 1, 1},
+      {EP_ATTR_ISOCHRONOUS, 4, 8},  {EP_ATTR_ISOCHRONOUS, 16, 32},
+  };
+  for (size_t i = 0; i < sizeof(periods) / sizeof(periods[0]); i++) {
+    desc[3] = periods[i].attr;
+    desc[6] = periods[i].interval;
+    pio_usb_host_endpoint_open(0, 2, desc, false);
+    endpoint_t *ep = _find_ep(0, 2, 0x81);
+    if (!ep || ep->period != periods[i].period || ep->phase != 0 ||
+        !(root->ep_periodic & PIO_USB_ENDPOINT_MASK(ep))) {
+      printf("\t[NG] Period of bInterval %d\n", periods[i].interval);
+      success = false;
+    }
+    pio_usb_host_endpoint_close(0, 2, 0x81);
+    if (ep && (root->ep_periodic & PIO_USB_ENDPOINT_MASK(ep))) {
+      printf("\t[NG] Closed endpoint is scheduled\n");
+      success = false;
+    }
+  }
+
+  // Endpoints of the same period take free phases first
+  desc[3] = EP_ATTR_INTERRUPT;
+  desc[6] = 8;
+  for (uint8_t num = 1; num <= 4; num++) {
+    desc[2] = 0x80 | num;
+    pio_usb_host_endpoint_open(0, 2, desc, false);
+    endpoint_t *ep = _find_ep(0, 2, desc[2]);
+    if (!ep || ep->phase != num - 1) {
+      printf("\t[NG] Phase of endpoint %d\n", num);
+      success = false;
+    }
+  }
+
+  // Phase of closed endpoint is reused
+  pio_usb_host_endpoint_close(0, 2, 0x82);
+  desc[2] = 0x85;
+  pio_usb_host_endpoint_open(0, 2, desc, false);
+  endpoint_t *ep = _find_ep(0, 2, 0x85);
+  if (!ep || ep->phase != 1) {
+    printf("\t[NG] Phase after close\n");
+    success = false;
+  }
+
+  pio_usb_host_close_device(0, 2);
+  if (!periodic_load_is_zero() || root->ep_periodic) {
+    printf("\t[NG] Schedule left after close\n");
+    success = false;
+  }
+
+  root->is_fullspeed = false;
+  return success;
+}
+
+static bool check_nak_backoff(endpoint_t *ep, uint8_t const *waits,
+                              size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    nak_backoff(ep);
+    uint16_t const resume = (uint16_t)(sof_count + waits[i]);
+    if (ep->nak_wait != waits[i] ||
+        (waits[i] && ep->nak_resume_frame != resume)) {
+      printf("\t[NG] NAK %d waits %d frames, expect %d\n", (int)i,
+             ep->nak_wait, waits[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Wait after NAK by policy, which restarts with a new transfer or policy
+static bool do_nak_backoff_test(void) {
+  static const uint8_t desc[] = {7, DESC_TYPE_ENDPOINT, 0x81,
+                                 EP_ATTR_BULK, 64, 0, 0};
+  static const uint8_t exponential[] = {2, 4, 8, 10, 10};
+  static const uint8_t fixed[] = {10, 10};
+  static const uint8_t none[] = {0, 0};
+  static uint8_t buffer[64];
+  uint32_t const frame = sof_count;
+  bool success = true;
+
+  pio_usb_host_endpoint_open(0, 2, desc, false);
+  endpoint_t *ep = _find_ep(0, 2, 0x81);
+  if (!ep) {
+    printf("\t[NG] Open endpoint\n");
+    return false;
+  }
+
+  sof_count = 0xfffe; // resume frame wraps
+  success &= check_nak_backoff(ep, none, sizeof(none));
+
+  pio_usb_host_endpoint_set_nak_policy(0, 2, 0x81,
+                                       PIO_USB_NAK_POLICY_EXPONENTIAL, 10);
+  success &= check_nak_backoff(ep, exponential, sizeof(exponential));
+
+  // New transfer is polled from the next frame, then backs off from start
+  pio_usb_ll_transfer_start(ep, buffer, sizeof(buffer));
+  if (ep->nak_wait != 0) {
+    printf("\t[NG] NAK wait kept by new transfer\n");
+    success = false;
+  }
+  success &= check_nak_backoff(ep, exponential, 2);
+  pio_usb_host_endpoint_abort_transfer(0, 2, 0x81);
+
+  pio_usb_host_endpoint_set_nak_policy(0, 2, 0x81, PIO_USB_NAK_POLICY_FIXED,
+                                       10);
+  if (ep->nak_wait != 0) {
+    printf("\t[NG] NAK wait kept by new policy\n");
+    success = false;
+  }
+  success &= check_nak_backoff(ep, fixed, sizeof(fixed));
+
+  pio_usb_host_close_device(0, 2);
+  sof_count = frame;
+  return success;
+}
+
+// Run pio_usb_host_task() at frame and check that it encoded the isochronous
+// OUT packet of the next scheduled frame
+static bool check_iso_out(endpoint_t *ep, pio_usb_iso_packet_t const *packets,
+                          uint8_t const *buffer, uint32_t frame) {
+  uint32_t const next = frame + ((ep->phase - frame) & (ep->period - 1));
+  uint16_t const idx = iso_packet_index(ep, next);
+
+  pio_usb_host_task();
+  if (!ep->tx_next_prepared || ep->iso_prepared_frame != next) {
+    printf("\t[NG] OUT packet of frame %d is not prepared\n", (int)next);
+    return false;
+  }
+  return compare_data_packet(ep, buffer + idx * ep->size, packets[idx].length,
+                             USB_PID_DATA0);
+}
+
+// Isochronous ring index follows frame number from the start frame, so
+// missed frames don't shift the ring. OUT packet of the next scheduled frame
+// is encoded by pio_usb_host_task().
+static bool do_iso_ring_test(void) {
+  static const uint8_t desc[] = {7, DESC_TYPE_ENDPOINT, 0x01,
+                                 EP_ATTR_ISOCHRONOUS, 64, 0, 3};
+  static uint8_t buffer[3 * 64];
+  pio_usb_iso_packet_t packets[3] = {
+      {PIO_USB_ISO_READY, 64, 0},
+      {PIO_USB_ISO_READY, 10, 0},
+      {PIO_USB_ISO_READY, 1, 0},
+  };
+  root_port_t *root = PIO_USB_ROOT_PORT(0);
+  uint32_t const frame = sof_count;
+  bool success = true;
+
+  // Frames after start, 16 is missed, and frame number wraps
+  static const struct {
+    uint32_t offset;
+    uint16_t idx;
+  } frames[] = {{0, 0}, {4, 1}, {8, 2}, {12, 0}, {20, 2}, {24, 0}};
+  endpoint_t ring;
+  memset(&ring, 0, sizeof(ring));
+  ring.period = 4;
+  ring.iso_count = 3;
+  ring.iso_start_frame = 0xfffffff8;
+  for (size_t i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+    uint16_t const idx =
+        iso_packet_index(&ring, ring.iso_start_frame + frames[i].offset);
+    if (idx != frames[i].idx) {
+      printf("\t[NG] Frame %d after start uses packet %d, expect %d\n",
+             (int)frames[i].offset, idx, frames[i].idx);
+      success = false;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = i * 7;
+  }
+
+  root->is_fullspeed = true;
+  pio_usb_host_endpoint_open(0, 3, desc, false);
+  endpoint_t *ep = _find_ep(0, 3, 0x01);
+  sof_count = 1000;
+  if (!ep || !pio_usb_host_endpoint_iso_start(0, 3, 0x01, packets, buffer,
+                                              3)) {
+    printf("\t[NG] Start isochronous ring\n");
+    success = false;
+  } else {
+    success &= check_iso_out(ep, packets, buffer, sof_count);
+
+    // Frame interrupt sent it, then missed two scheduled frames
+    ep->tx_next_prepared = false;
+    sof_count = ep->iso_prepared_frame + 2 * ep->period + 1;
+    success &= check_iso_out(ep, packets, buffer, sof_count);
+
+    // Packet which is not READY is not encoded
+    uint32_t const next = ep->iso_prepared_frame + ep->period;
+    ep->tx_next_prepared = false;
+    sof_count = next;
+    packets[iso_packet_index(ep, next)].status = PIO_USB_ISO_IDLE;
+    pio_usb_host_task();
+    if (ep->tx_next_prepared) {
+      printf("\t[NG] Skipped OUT packet is prepared\n");
+      success = false;
+    }
+
+    pio_usb_host_endpoint_abort_transfer(0, 3, 0x01);
+  }
+
+  pio_usb_host_close_device(0, 3);
+  root->is_fullspeed = false;
+  sof_count = frame;
+  return success;
+}
+
+// Estimated bus time of transactions with worst case bit stuffing
+static bool do_transaction_time_test(void) {
+  static const struct {
+    uint16_t len;
+    bool low_speed;
+    bool need_pre;
+    uint32_t time_us;
+  } cases[] = {
+      {0, false, false, 11},  {64, false, false, 61}, {0, true, false, 88},
+      {8, true, false, 137},  {0, true, true, 91},    {8, true, true, 140},
+  };
+  endpoint_t ep;
+  bool success = true;
+
+  memset(&ep, 0, sizeof(ep));
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    ep.need_pre = cases[i].need_pre;
+    uint32_t const time_us =
+        transaction_time_us(&ep, cases[i].len, cases[i].low_speed);
+    if (time_us != cases[i].time_us) {
+      printf("\t[NG] Transaction time of %d bytes: %d us, expect %d us\n",
+             cases[i].len, (int)time_us, (int)cases[i].time_us);
+      success = false;
+    }
+  }
+
+  return success;
+}
+
+#if PIO_USB_HOST_FRAME_BUDGET_US
+// Endpoint whose transaction doesn't fit in the rest of frame is skipped, and
+// a shorter one still goes
+static bool do_frame_budget_test(void) {
+  uint32_t const budget = PIO_USB_HOST_FRAME_BUDGET_US;
+  pio_port_t *pp = PIO_USB_PIO_PORT(0);
+  root_port_t *root = PIO_USB_ROOT_PORT(0);
+  endpoint_t *large = PIO_USB_ENDPOINT(0);
+  endpoint_t *zlp = PIO_USB_ENDPOINT(1);
+  bool success = true;
+
+  memset(large, 0, sizeof(*large));
+  memset(zlp, 0, sizeof(*zlp));
+  large->size = zlp->size = 64;
+  large->total_len = 64; // 61 us at full-speed
+  zlp->total_len = 0;    // 11 us
+  pp->low_speed = false;
+
+  static const struct {
+    uint32_t left_us;
+    int large_fit;
+    int zlp_fit;
+  } cases[] = {
+      {100, 1, 1}, {61, 1, 1}, {60, 0, 1}, {11, 0, 1}, {10, -1, -1},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    uint32_t const elapsed = budget - cases[i].left_us;
+    if (frame_budget_fit(pp, large, elapsed) != cases[i].large_fit ||
+        frame_budget_fit(pp, zlp, elapsed) != cases[i].zlp_fit) {
+      printf("\t[NG] Budget fit with %d us left\n", (int)cases[i].left_us);
+      success = false;
+    }
+  }
+
+  // 8 bytes take 137 us at low-speed
+  pp->low_speed = true;
+  large->total_len = 8;
+  if (frame_budget_fit(pp, large, budget - 137) != 1 ||
+      frame_budget_fit(pp, large, budget - 136) != 0) {
+    printf("\t[NG] Budget fit at low-speed\n");
+    success = false;
+  }
+  pp->low_speed = false;
+
+  // Both are skipped when neither fits, and none fits at the end of budget.
+  // Stub bus would never complete a transaction.
+  large->total_len = zlp->total_len = 64;
+  large->has_transfer = zlp->has_transfer = true;
+  root->is_fullspeed = true;
+  root->connected = true;
+  root->suspended = false;
+  root->ep_active = PIO_USB_ENDPOINT_MASK(large) | PIO_USB_ENDPOINT_MASK(zlp);
+  host_timer_set_us(budget - 30);
+  run_frame_budget(pp, 0, root->ep_active);
+  host_timer_set_us(budget);
+  run_frame_budget(pp, 0, root->ep_active);
+  if (large->failed_count || zlp->failed_count || !large->has_transfer ||
+      !zlp->has_transfer) {
+    printf("\t[NG] Transaction beyond budget\n");
+    success = false;
+  }
+
+  root->is_fullspeed = false;
+  root->connected = false;
+  root->ep_active = 0;
+  host_timer_set_us(0);
+  memset(large, 0, sizeof(*large));
+  memset(zlp, 0, sizeof(*zlp));
+  return success;
+}
+#endif
+
+static uint64_t get_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Same output as Test 9 of test_ll, but measured on the host
+#define BENCHMARK(name, count, expr)                                    \
+  do {                                                                  \
+    uint64_t const start = get_time_ns();                               \
+    for (int i = 0; i < (count); i++) {                                 \
+      expr;                                                             \
+    }                                                                   \
+    uint64_t const diff = get_time_ns() - start;                        \
+    printf("bench,%s,%d\n", name, (int)(diff / (count)));               \
+  } while (0)
+
+static void do_benchmark(void) {
+  static uint8_t buffer[PIO_USB_EP_SIZE];
+  static uint8_t encoded[PIO_USB_TX_ENCODED_LEN(PIO_USB_EP_SIZE)];
+  volatile uint32_t sink = 0;
+
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = i;
+  }
+
+  BENCHMARK("calc_usb_crc5", 1000000, sink += calc_usb_crc5(i & 0x7ff));
+  BENCHMARK("calc_usb_crc16_64", 100000,
+            sink += calc_usb_crc16(buffer, sizeof(buffer)));
+  BENCHMARK("calc_usb_crc16_nibble_64", 100000,
+            sink += calc_usb_crc16_nibble(buffer, sizeof(buffer)));
+  BENCHMARK("calc_usb_crc16_slice4_64", 100000,
+            sink += calc_usb_crc16_slice4(buffer, sizeof(buffer)));
+  // interp is emulated in the stub, so this doesn't tell the target speed
+  usb_crc16_interp_init();
+  BENCHMARK("calc_usb_crc16_interp_64", 100000,
+            sink += calc_usb_crc16_interp(buffer, sizeof(buffer)));
+  BENCHMARK("encode_tx_data_8", 100000,
+            sink += pio_usb_ll_encode_tx_data(buffer, 8, encoded));
+  BENCHMARK("encode_tx_data_64", 100000,
+            sink += pio_usb_ll_encode_tx_data(buffer, sizeof(buffer), encoded));
+  memset(buffer, 0xff, sizeof(buffer)); // worst case bit stuffing
+  BENCHMARK("encode_tx_data_64_stuffed", 100000,
+            sink += pio_usb_ll_encode_tx_data(buffer, sizeof(buffer), encoded));
+  (void)sink;
+}
+
+// Frame interrupt without devices, which is SOF encoding and the loop
+// overhead. Built per PIO_USB_SOF_ENCODE option, the difference between
+// variants is the interrupt time saved by encoding SOF ahead.
+static void do_frame_benchmark(void) {
+  BENCHMARK("host_frame", 100000, pio_usb_host_frame());
+
+  // Only the interrupt is timed, minus the cost of reading the clock
+  int const count = 100000;
+  uint64_t frame_ns = 0;
+  uint64_t clock_ns = 0;
+  for (int i = 0; i < count; i++) {
+    pio_usb_host_task();
+    uint64_t const start = get_time_ns();
+    pio_usb_host_frame();
+    uint64_t const mid = get_time_ns();
+    uint64_t const end = get_time_ns();
+    frame_ns += mid - start;
+    clock_ns += end - mid;
+  }
+  printf("bench,host_frame_after_task,%d\n",
+         (int)((frame_ns - clock_ns) / count));
+}
+
+int main(void) {
+  bool success = true;
+
+  // Claims spinlock used by transfer functions. No device is attached, so
+  // frame interrupt only sends SOF.
+  pio_usb_configuration_t config = PIO_USB_DEFAULT_CONFIG;
+  config.skip_alarm_pool = true;
+  pio_usb_host_init(&config);
+
+  printf("Encode Golden\n");
+  success &= do_encode_test();
+
+  printf("CRC and Token Golden\n");
+  success &= do_crc_token_test();
+
+  printf("DATA Packet Golden\n");
+  success &= do_data_packet_test();
+
+  printf("Endpoint Replug\n");
+  success &= do_replug_test();
+
+  printf("Periodic Schedule\n");
+  success &= do_periodic_schedule_test();
+
+  printf("NAK Backoff\n");
+  success &= do_nak_backoff_test();
+
+  printf("Isochronous Ring\n");
+  success &= do_iso_ring_test();
+
+  printf("Transaction Time\n");
+  success &= do_transaction_time_test();
+#if PIO_USB_HOST_FRAME_BUDGET_US
+  printf("Frame Budget\n");
+  success &= do_frame_budget_test();
+#endif
+
+  printf("Benchmark\n");
+  do_benchmark();
+  do_frame_benchmark();
+
+  printf("%s\n", success ? "[OK]" : "[NG]");
+  return success ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+# Generate TX encoder lookup tables in src/pio_usb.c
+#
+# USB sends LSB first with NRZI: 0 toggles line state, 1 keeps it. A stuffing
+# 0 is inserted after six consecutive 1. Each bit becomes a 2bit symbol, the
+# address of TX PIO instruction which drives K or J. Symbols are generated for
+# line state 1 and inverted by the encoder while line state is 0.
+#
+# usage: tools/gen_tx_encode_tbl.py > tables.txt
+
+K = 1  # PIO_USB_TX_ENCODED_DATA_K
+J = 3  # PIO_USB_TX_ENCODED_DATA_J
+
+
+def encode(bits, run):
+    """NRZI encode bits from line state 1, with run of 1 before them.
+    Returns symbols, line state and run of 1 after them."""
+    state = 1
+    symbols = []
+    for bit in bits:
+        if bit:
+            run += 1
+        else:
+            state ^= 1
+            run = 0
+        symbols.append(K if state else J)
+        if run == 6:
+            state ^= 1
+            run = 0
+            symbols.append(K if state else J)
+    return symbols, state, run
+
+
+def pack(symbols):
+    value = 0
+    for symbol in symbols:
+        value = (value << 2) | symbol
+    return value
+
+
+def byte_entry(data):
+    """[15:0] symbols, [18:16] run after, [19] flip, [22:20] run limit.
+    0 if the byte may need bit stuffing for any preceding run."""
+    bits = [(data >> i) & 1 for i in range(8)]
+    leading_ones = next((i for i, bit in enumerate(bits) if not bit), 8)
+    longest = max(len(r) for r in ''.join(map(str, bits)).split('0'))
+    if longest >= 6:
+        return 0
+    # stuffing is needed if preceding run + leading ones reaches 6
+    limit = 6 - leading_ones
+    symbols, state, run = encode(bits, 0)
+    for run_before in range(limit):
+        assert encode(bits, run_before) == (symbols, state, run)
+    return pack(symbols) | (run << 16) | ((state ^ 1) << 19) | (limit << 20)
+
+
+def nibble_entry(run_before, data):
+    """[9:0] 4 or 5 symbols, [10] stuffed, [13:11] run after, [14] flip"""
+    bits = [(data >> i) & 1 for i in range(4)]
+    symbols, state, run = encode(bits, run_before)
+    stuffed = len(symbols) - 4
+    return pack(symbols) | (stuffed << 10) | (run << 11) | ((state ^ 1) << 14)
+
+
+def print_table(values, width):
+    for i in range(0, len(values), 8):
+        print('    ' + ' '.join('0x%0*x,' % (width, v) for v in values[i:i + 8]))
+
+
+print('tx_encode_byte_tbl[256]')
+print_table([byte_entry(data) for data in range(256)], 6)
+print()
+print('tx_encode_nibble_tbl[6 * 16]')
+print_table([nibble_entry(run, data) for run in range(6) for data in range(16)], 4)